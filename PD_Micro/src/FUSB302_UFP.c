@@ -39,6 +39,8 @@
 
 /* Measure : 04h */
 #define MEAS_VBUS       (0x01 << 6)
+#define MDAC_MASK       (0x3F << 0)
+#define MDAC_VBUS_MV    420     /* MDAC LSB with MEAS_VBUS, threshold is (MDAC + 1) * 420mV */
 
 /* Control0 : 06h */
 #define TX_FLUSH        (0x01 << 6)
@@ -233,9 +235,20 @@ enum FUSB302_transmit_data_tokens_t {
 
 enum FUSB302_state_t {
     FUSB302_STATE_UNATTACHED = 0,
+    FUSB302_STATE_ATTACH_CC1,       /* measure vRd on CC1 */
+    FUSB302_STATE_ATTACH_CC2,       /* measure vRd on CC2 */
+    FUSB302_STATE_ATTACH_DONE,      /* enable tx on detected CC pin */
     FUSB302_STATE_ATTACHED
 };
 
+#define t_CC_SETTLE         1       /* ms, measure block settle time after switching CC pin */
+#define t_CC_DEBOUNCE       10      /* ms, take last BC_LVL sample if not stable within this time */
+#define N_CC_STABLE         6       /* number of identical BC_LVL samples to accept */
+#define t_VBUS_ON           275     /* ms, tVBUSON, source turns VBUS on after toggle reports Rp */
+#define t_PD_DEBOUNCE       15      /* ms, CC open for this time is detach while VBUSOK is ignored */
+#define VBUS_DETACH_MV      3000    /* mV, VBUS below PPS minimum of 3.3V confirms CC open as detach */
+#define t_CC_OPEN_VBUS      100     /* ms, CC open with VBUS still up is detach, bounds a slow rail discharge */
+
 #define FUSB302_ERR_MSG(s)  s
 
 #define REG_READ(addr, data, count) do { \
@@ -246,10 +259,19 @@ enum FUSB302_state_t {
     if (reg_write(dev, addr, data, count) != FUSB302_SUCCESS) { return FUSB302_ERR_WRITE_DEVICE; } \
 } while(0)
 
+/* Update control register shadow, written to device on REG_COMMIT only if value changed */
+#define REG_SET(addr, value)    reg_set(dev, addr, value)
+
+#define REG_COMMIT() do { \
+    if (reg_commit(dev) != FUSB302_SUCCESS) { return FUSB302_ERR_WRITE_DEVICE; } \
+} while(0)
+
 static inline FUSB302_ret_t reg_read(FUSB302_dev_t *dev, uint8_t address, uint8_t *data, uint8_t count)
 {
-    FUSB302_ret_t ret = dev->i2c_read(dev->i2c_address, address, data, count);
+    FUSB302_ret_t ret = dev->i2c_read(dev->context, dev->i2c_address, address, data, count);
+    dev->i2c_count++;
     if (ret != FUSB302_SUCCESS) {
+        dev->i2c_err_count++;
         dev->err_msg = FUSB302_ERR_MSG("Fail to read register");
     }
     return ret;
@@ -257,147 +279,469 @@ static inline FUSB302_ret_t reg_read(FUSB302_dev_t *dev, uint8_t address, uint8_
 
 static inline FUSB302_ret_t reg_write(FUSB302_dev_t *dev, uint8_t address, uint8_t *data, uint8_t count)
 {
-    FUSB302_ret_t ret = dev->i2c_write(dev->i2c_address, address, data, count);
+    FUSB302_ret_t ret = dev->i2c_write(dev->context, dev->i2c_address, address, data, count);
+    dev->i2c_count++;
     if (ret != FUSB302_SUCCESS) {
+        dev->i2c_err_count++;
         dev->err_msg = FUSB302_ERR_MSG("Fail to write register");
     }
     return ret;
 }
 
-static FUSB302_ret_t FUSB302_read_cc_lvl(FUSB302_dev_t *dev, uint8_t * cc_value)
+static inline void reg_set(FUSB302_dev_t *dev, uint8_t address, uint8_t value)
 {
-    /*  00: < 200 mV          : vRa
-        01: >200 mV, <660 mV  : vRd-USB
-        10: >660 mV, <1.23 V  : vRd-1.5
-        11: >1.23 V           : vRd-3.0  */
-    uint8_t cc, cc_verify;
-    REG_READ(ADDRESS_STATUS0, &REG_STATUS0, 1);
-    cc = REG_STATUS0 & BC_LVL_MASK;
-    for (uint8_t i = 0; i < 5; i++) {
-        REG_READ(ADDRESS_STATUS0, &REG_STATUS0, 1);
-        cc_verify = REG_STATUS0 & BC_LVL_MASK;
-        if (cc != cc_verify) {
-            return FUSB302_BUSY;
+    uint8_t i = address - ADDRESS_DEVICE_ID;
+    if (dev->reg_control[i] != value) {
+        dev->reg_control[i] = value;
+        dev->reg_dirty |= (uint16_t)1 << i;
+    }
+}
+
+/* Mark register to be written on REG_COMMIT without change, e.g. to join two dirty registers in one burst */
+static inline void reg_touch(FUSB302_dev_t *dev, uint8_t address)
+{
+    dev->reg_dirty |= (uint16_t)1 << (address - ADDRESS_DEVICE_ID);
+}
+
+static FUSB302_ret_t reg_commit(FUSB302_dev_t *dev)
+{
+    /* Write each run of contiguous dirty registers in one burst.
+       Dirty bits are kept on failure, registers are written again on next commit */
+    uint8_t i = 0;
+    while (dev->reg_dirty >> i) {
+        if (dev->reg_dirty & ((uint16_t)1 << i)) {
+            uint8_t n = 1;
+            uint16_t run;
+            while (dev->reg_dirty & ((uint16_t)1 << (i + n))) {
+                n++;
+            }
+            run = (((uint16_t)1 << n) - 1) << i;
+            if (reg_write(dev, ADDRESS_DEVICE_ID + i, &dev->reg_control[i], n) != FUSB302_SUCCESS) {
+                return FUSB302_ERR_WRITE_DEVICE;
+            }
+            dev->reg_dirty &= ~run;
+            i += n;
+        } else {
+            i++;
         }
     }
-    *cc_value = cc;
-	return FUSB302_SUCCESS;
+    return FUSB302_SUCCESS;
+}
+
+#define RX_QUEUE_MASK       (FUSB302_RX_QUEUE_SIZE - 1)
+#define EVENT_QUEUE_MASK    (FUSB302_EVENT_QUEUE_SIZE - 1)
+
+static void FUSB302_push_event(FUSB302_dev_t *dev, FUSB302_event_t * events, FUSB302_event_t event)
+{
+    uint8_t w = dev->event_write;
+    if ((uint8_t)(w - dev->event_read) <= EVENT_QUEUE_MASK) {
+        dev->event_queue[w & EVENT_QUEUE_MASK] = event;
+        dev->event_write = w + 1;
+    }
+    if (events) {
+        *events |= event;
+    }
 }
 
-static FUSB302_ret_t FUSB302_read_incoming_packet(FUSB302_dev_t *dev, FUSB302_event_t * events)
+static inline uint8_t FUSB302_rx_queue_full(FUSB302_dev_t *dev)
 {
-    uint8_t len, b[3];
+    return (uint8_t)(dev->rx_write - dev->rx_read) > RX_QUEUE_MASK;
+}
+
+static inline uint8_t FUSB302_rx_sop(uint8_t token)
+{
+    /* RX token B7...5: 111b SOP, 110b SOP', 101b SOP'' */
+    return (token & 0xE0) == 0xC0 ? FUSB302_SOP_PRIME : (token & 0xE0) == 0xA0 ? FUSB302_SOP_DPRIME : FUSB302_SOP;
+}
+
+static inline uint8_t FUSB302_rx_token_valid(uint8_t token)
+{
+    /* SOP* tokens only, anything else means the FIFO is out of step with packet boundaries */
+    return (token & 0xE0) == 0xE0 || (token & 0xE0) == 0xC0 || (token & 0xE0) == 0xA0;
+}
+
+static FUSB302_ret_t FUSB302_rx_flush(FUSB302_dev_t *dev)
+{
+    uint8_t rx_flush = REG_CONTROL1 | RX_FLUSH;
+    REG_WRITE(ADDRESS_CONTROL1, &rx_flush, 1);
+    REG_STATUS1 |= RX_EMPTY;
+    return FUSB302_SUCCESS;
+}
+
+static FUSB302_ret_t FUSB302_read_incoming_packet(FUSB302_dev_t *dev, uint8_t *valid)
+{
+    /* read into next free rx queue slot, committed by caller, *valid is 0 for a bad token */
+    FUSB302_rx_msg_t *msg = &dev->rx_msg[dev->rx_write & RX_QUEUE_MASK];
+    uint8_t len, b[7 * 4 + 4];
+    *valid = 0;
     REG_READ(ADDRESS_FIFOS, b, 3);
-    dev->rx_header = ((uint16_t)b[2] << 8) | b[1];
-    len = (dev->rx_header >> 12) & 0x7;
-    REG_READ(ADDRESS_FIFOS, dev->rx_buffer, len * 4 + 4);  /* add 4 to len to read CRC out */
+    if (!FUSB302_rx_token_valid(b[0])) {
+        return FUSB302_SUCCESS;
+    }
+    msg->header = ((uint16_t)b[2] << 8) | b[1];
+    msg->sop = FUSB302_rx_sop(b[0]);
+    len = (msg->header >> 12) & 0x7;
+    REG_READ(ADDRESS_FIFOS, b, len * 4 + 4);  /* add 4 to len to read CRC out */
+    memcpy(msg->data, b, len * 4);
+    *valid = 1;
+    return FUSB302_SUCCESS;
+}
 
-    if (events) {
-        *events |= FUSB302_EVENT_RX_SOP;
+/* Burst layout: STATUS0A ... INTERRUPT, then FIFO token, header and data objects with CRC */
+#define BURST_STATUS_LEN    (ADDRESS_INTERRUPT - ADDRESS_STATUS0A + 1)
+#define BURST_HEADER_LEN    (BURST_STATUS_LEN + 3)
+#define BURST_MAX_LEN       (BURST_HEADER_LEN + 7 * 4 + 4)
+
+static uint8_t FUSB302_burst_len(const uint8_t *data, uint8_t received, uint8_t count)
+{
+    if (received == ADDRESS_STATUS1 - ADDRESS_STATUS0A + 1) {
+        /* STATUS1 received, continue into the FIFO only if a packet is waiting */
+        return (data[ADDRESS_STATUS1 - ADDRESS_STATUS0A] & RX_EMPTY) ? BURST_STATUS_LEN : BURST_HEADER_LEN;
+    }
+    if (received == BURST_HEADER_LEN) {
+        /* header received, add data objects and CRC */
+        return BURST_HEADER_LEN + ((data[BURST_HEADER_LEN - 1] >> 4) & 0x7) * 4 + 4;
+    }
+    return count;
+}
+
+static FUSB302_ret_t FUSB302_read_status(FUSB302_dev_t *dev, uint8_t *rx)
+{
+    /* Read status and interrupt registers. With i2c_read_burst and a free rx queue slot, register
+       address auto-increments from STATUS0A up to FIFOS and stays there, so a whole packet is
+       fetched in the same transaction, *rx is set to 1 if so */
+    *rx = 0;
+    if (dev->i2c_read_burst && !FUSB302_rx_queue_full(dev)) {
+        uint8_t b[BURST_MAX_LEN];
+        FUSB302_ret_t ret = dev->i2c_read_burst(dev->context, dev->i2c_address, ADDRESS_STATUS0A, b, BURST_STATUS_LEN, FUSB302_burst_len);
+        dev->i2c_count++;
+        if (ret != FUSB302_SUCCESS) {
+            dev->i2c_err_count++;
+            dev->err_msg = FUSB302_ERR_MSG("Fail to read register");
+            return FUSB302_ERR_READ_DEVICE;
+        }
+        memcpy(dev->reg_status, b, BURST_STATUS_LEN);
+        if ((REG_STATUS1 & RX_EMPTY) == 0 && !FUSB302_rx_token_valid(b[BURST_STATUS_LEN])) {
+            if (FUSB302_rx_flush(dev) != FUSB302_SUCCESS) {
+                return FUSB302_ERR_WRITE_DEVICE;
+            }
+        } else if ((REG_STATUS1 & RX_EMPTY) == 0) {
+            FUSB302_rx_msg_t *msg = &dev->rx_msg[dev->rx_write & RX_QUEUE_MASK];
+            msg->header = ((uint16_t)b[BURST_STATUS_LEN + 2] << 8) | b[BURST_STATUS_LEN + 1];
+            msg->sop = FUSB302_rx_sop(b[BURST_STATUS_LEN]);
+            memcpy(msg->data, &b[BURST_HEADER_LEN], ((msg->header >> 12) & 0x7) * 4);
+            *rx = 1;
+        }
+    } else {
+        REG_READ(ADDRESS_STATUS0A, &REG_STATUS0A, BURST_STATUS_LEN);
     }
+    dev->interrupta |= REG_INTERRUPTA;
+    dev->interruptb |= REG_INTERRUPTB;
+    return FUSB302_SUCCESS;
+}
+
+static FUSB302_ret_t FUSB302_set_unattached(FUSB302_dev_t *dev)
+{
+    /* reset cc pins to pull down */
+    REG_SET(ADDRESS_SWITCHES0, PDWN1 | PDWN2);
+    REG_SET(ADDRESS_SWITCHES1, SPECREV0);
+    REG_SET(ADDRESS_MEASURE, 49);
+
+    /* turn off internal oscillator, SOP' receive is enabled per cable discovery only */
+    REG_SET(ADDRESS_POWER, PWR_BANDGAP | PWR_RECEIVER | PWR_MEASURE);
+    REG_SET(ADDRESS_CONTROL1, REG_CONTROL1 & ~ENSOP1);
+
+    if (dev->toggle) {
+        /* restart autonomous attach detection as sink */
+        REG_SET(ADDRESS_CONTROL2, (REG_CONTROL2 & ~MODE_MASK) | MODE_UFP | TOGGLE);
+    }
+
+    dev->state = FUSB302_STATE_UNATTACHED;
+    REG_COMMIT();
     return FUSB302_SUCCESS;
 }
 
+static FUSB302_ret_t FUSB302_state_toggling(FUSB302_dev_t *dev)
+{
+    /* FUSB302 toggles pull-downs and watches for Rp by itself, only read on interrupt */
+    REG_READ(ADDRESS_STATUS0A, &REG_STATUS0A, BURST_STATUS_LEN);
+    if ((REG_INTERRUPTA & I_TOGDONE) == 0) {
+        return FUSB302_SUCCESS;
+    }
+    switch (REG_STATUS1A & TOGSS_MASK) {
+    case TOGSS_SNK1:
+        dev->state = FUSB302_STATE_ATTACH_CC1;
+        break;
+    case TOGSS_SNK2:
+        dev->state = FUSB302_STATE_ATTACH_CC2;
+        break;
+    default:
+        /* not a source attach, restart toggle */
+        REG_SET(ADDRESS_CONTROL2, REG_CONTROL2 & ~TOGGLE);
+        REG_COMMIT();
+        REG_SET(ADDRESS_CONTROL2, REG_CONTROL2 | TOGGLE);
+        REG_COMMIT();
+        return FUSB302_SUCCESS;
+    }
+    /* stop toggle and enable internal oscillator, written on next step. Only the
+       CC pin reported by toggle is measured */
+    dev->time_toggle_done = dev->clock_ms();
+    REG_SET(ADDRESS_CONTROL2, REG_CONTROL2 & ~TOGGLE);
+    REG_SET(ADDRESS_POWER, PWR_BANDGAP | PWR_RECEIVER | PWR_MEASURE | PWR_INT_OSC);
+    dev->cc1 = 0;
+    dev->cc2 = 0;
+    return FUSB302_BUSY;
+}
+
 static FUSB302_ret_t FUSB302_state_unattached(FUSB302_dev_t *dev, FUSB302_event_t * events)
 {
+    if (dev->toggle) {
+        return FUSB302_state_toggling(dev);
+    }
     REG_READ(ADDRESS_STATUS0, &REG_STATUS0, 1);
     if (REG_STATUS0 & VBUSOK) {
-        /* enable internal oscillator */
-        REG_POWER = PWR_BANDGAP | PWR_RECEIVER | PWR_MEASURE | PWR_INT_OSC;
-        REG_WRITE(ADDRESS_POWER, &REG_POWER, 1);
-        dev->delay_ms(1);
-
-        /* read cc1 */
-        REG_SWITCHES0 = PDWN1 | PDWN2 | MEAS_CC1;
-        REG_SWITCHES1 = SPECREV0;
-        REG_MEASURE = 49;
-        REG_WRITE(ADDRESS_SWITCHES0, &REG_SWITCHES0, 3);
-        dev->delay_ms(1);
-        while (FUSB302_read_cc_lvl(dev, &dev->cc1) != FUSB302_SUCCESS) {
-            dev->delay_ms(1);
-        }
+        /* enable internal oscillator, written on next step */
+        REG_SET(ADDRESS_POWER, PWR_BANDGAP | PWR_RECEIVER | PWR_MEASURE | PWR_INT_OSC);
+        dev->state = FUSB302_STATE_ATTACH_CC1;
+        dev->cc1 = 0;
+        dev->cc2 = 0;
+        return FUSB302_BUSY;
+    }
+    return FUSB302_SUCCESS;
+}
 
-        /* read cc2 */
-        REG_SWITCHES0 = PDWN1 | PDWN2 | MEAS_CC2;
-        REG_WRITE(ADDRESS_SWITCHES0, &REG_SWITCHES0, 1);
-        dev->delay_ms(1);
-        while (FUSB302_read_cc_lvl(dev, &dev->cc2) != FUSB302_SUCCESS) {
-            dev->delay_ms(1);
-        }
+static FUSB302_ret_t FUSB302_state_attaching(FUSB302_dev_t *dev, FUSB302_event_t * events)
+{
+    /* Resumable attach detection, each call does at most one I2C transaction:
+       a pending register write, or one sample of STATUS0. Return FUSB302_BUSY until attached */
+    uint16_t t = dev->clock_ms();
+    uint8_t cc;
+    if (dev->reg_dirty) {
+        REG_COMMIT();
+        dev->time_attach = t;
+        dev->cc_count = 0;
+        return FUSB302_BUSY;
+    }
 
+    if (dev->state == FUSB302_STATE_ATTACH_DONE) {
         /* clear interrupt */
         REG_READ(ADDRESS_INTERRUPTA, &REG_INTERRUPTA, 2);
         dev->interrupta = 0;
-        dev->interruptb = 0;        
-
-        /* enable tx on cc pin */
-        if (dev->cc1 > 0) {
-            REG_SWITCHES0 = PDWN1 | PDWN2 | MEAS_CC1;
-            REG_SWITCHES1 = SPECREV0 | AUTO_CRC | TXCC1;
-            //REG_SWITCHES1 = SPECREV0 | TXCC1;
-        } else if (dev->cc2 > 0) {
-            REG_SWITCHES0 = PDWN1 | PDWN2 | MEAS_CC2;
-            REG_SWITCHES1 = SPECREV0 | AUTO_CRC | TXCC2;
-            //REG_SWITCHES1 = SPECREV0 | TXCC2;
-        } else {
-            REG_SWITCHES0 = PDWN1 | PDWN2;
-            REG_SWITCHES1 = SPECREV0;
-        }
-        REG_WRITE(ADDRESS_SWITCHES0, &REG_SWITCHES0, 2);
+        dev->interruptb = 0;
 
         /* update state */
         dev->state = FUSB302_STATE_ATTACHED;
-        if (events) {
-            *events |= FUSB302_EVENT_ATTACHED;
+        FUSB302_push_event(dev, events, FUSB302_EVENT_ATTACHED);
+        return FUSB302_SUCCESS;
+    }
+
+    cc = dev->state == FUSB302_STATE_ATTACH_CC1 ? MEAS_CC1 : MEAS_CC2;
+    if (REG_SWITCHES0 != (PDWN1 | PDWN2 | cc)) {
+        /* connect measure block to cc pin */
+        REG_SET(ADDRESS_SWITCHES0, PDWN1 | PDWN2 | cc);
+        REG_SET(ADDRESS_SWITCHES1, SPECREV0);
+        REG_SET(ADDRESS_MEASURE, 49);
+        REG_COMMIT();
+        dev->time_attach = t;
+        dev->cc_count = 0;
+        return FUSB302_BUSY;
+    }
+    if ((uint16_t)(t - dev->time_attach) <= t_CC_SETTLE) {
+        return FUSB302_BUSY;
+    }
+
+    /*  00: < 200 mV          : vRa
+        01: >200 mV, <660 mV  : vRd-USB
+        10: >660 mV, <1.23 V  : vRd-1.5
+        11: >1.23 V           : vRd-3.0  */
+    REG_READ(ADDRESS_STATUS0, &REG_STATUS0, 1);
+    if ((REG_STATUS0 & VBUSOK) == 0) {
+        if (dev->toggle && (REG_STATUS0 & BC_LVL_MASK) && (uint16_t)(t - dev->time_toggle_done) < t_VBUS_ON) {
+            /* toggle sees Rp before VBUS is on, debounce CC again once it is */
+            dev->time_attach = t;
+            dev->cc_count = 0;
+            return FUSB302_BUSY;
         }
+        return FUSB302_set_unattached(dev);
+    }
+    cc = REG_STATUS0 & BC_LVL_MASK;
+    if (dev->cc_count && cc == dev->cc_last) {
+        dev->cc_count++;
+    } else {
+        dev->cc_last = cc;
+        dev->cc_count = 1;
+    }
+    if (dev->cc_count < N_CC_STABLE && (uint16_t)(t - dev->time_attach) < t_CC_DEBOUNCE) {
+        return FUSB302_BUSY;
     }
+
+    if (dev->state == FUSB302_STATE_ATTACH_CC1) {
+        dev->cc1 = cc;
+        if (dev->toggle == 0) {
+            dev->state = FUSB302_STATE_ATTACH_CC2;
+            return FUSB302_BUSY;
+        }
+    } else {
+        dev->cc2 = cc;
+    }
+
+    /* enable tx on cc pin, written on next step */
+    if (dev->cc1 > 0) {
+        REG_SET(ADDRESS_SWITCHES0, PDWN1 | PDWN2 | MEAS_CC1);
+        REG_SET(ADDRESS_SWITCHES1, SPECREV0 | AUTO_CRC | TXCC1);
+        //REG_SET(ADDRESS_SWITCHES1, SPECREV0 | TXCC1);
+    } else if (dev->cc2 > 0) {
+        REG_SET(ADDRESS_SWITCHES0, PDWN1 | PDWN2 | MEAS_CC2);
+        REG_SET(ADDRESS_SWITCHES1, SPECREV0 | AUTO_CRC | TXCC2);
+        //REG_SET(ADDRESS_SWITCHES1, SPECREV0 | TXCC2);
+    } else {
+        REG_SET(ADDRESS_SWITCHES0, PDWN1 | PDWN2);
+        REG_SET(ADDRESS_SWITCHES1, SPECREV0);
+    }
+    dev->state = FUSB302_STATE_ATTACH_DONE;
+    return FUSB302_BUSY;
+}
+
+static FUSB302_ret_t FUSB302_set_detached(FUSB302_dev_t *dev, FUSB302_event_t * events)
+{
+    /* next connection starts at vSafe5V, VBUSOK is valid again */
+    if (FUSB302_set_vbus_sense(dev, 1) != FUSB302_SUCCESS || FUSB302_set_unattached(dev) != FUSB302_SUCCESS) {
+        return FUSB302_ERR_WRITE_DEVICE;
+    }
+    /* drop messages and events of the previous connection */
+    dev->rx_read = dev->rx_write;
+    dev->event_read = dev->event_write;
+    FUSB302_push_event(dev, events, FUSB302_EVENT_DETACHED);
+    return FUSB302_SUCCESS;
+}
+
+static FUSB302_ret_t vbus_measure(FUSB302_dev_t *dev, uint8_t mdac, uint8_t *count);
+
+static FUSB302_ret_t FUSB302_check_cc_open(FUSB302_dev_t *dev, uint8_t *detached)
+{
+    /* VBUSOK is ignored in PPS mode, detach when Rp is gone from the CC pin (BC_LVL below 200mV, not
+       BMC traffic) for t_PD_DEBOUNCE and VBUS fell below VBUS_DETACH_MV, or for t_CC_OPEN_VBUS.
+       Only BC_LVL is sampled while debouncing, VBUS is measured once after it and MEAS_CC restored */
+    uint16_t t = dev->clock_ms(), open;
+    uint8_t above = 1;
+    *detached = 0;
+    if ((REG_STATUS0 & (BC_LVL_MASK | ACTIVITY)) != BC_LVL_LT200) {
+        dev->cc_open = 0;
+        return FUSB302_SUCCESS;
+    }
+    if (dev->cc_open == 0) {
+        dev->cc_open = 1;
+        dev->time_cc_open = t;
+    }
+    open = t - dev->time_cc_open;
+    if (open < t_PD_DEBOUNCE) {
+        return FUSB302_SUCCESS;
+    }
+    if (dev->cc_open == 1) {
+        dev->cc_open = 2;   /* VBUS checked */
+        if (vbus_measure(dev, VBUS_DETACH_MV / MDAC_VBUS_MV - 1, &above) != FUSB302_SUCCESS) {
+            return FUSB302_ERR_READ_DEVICE;
+        }
+    }
+    *detached = !above || open >= t_CC_OPEN_VBUS;
     return FUSB302_SUCCESS;
 }
 
 static FUSB302_ret_t FUSB302_state_attached(FUSB302_dev_t *dev, FUSB302_event_t * events)
 {
-    REG_READ(ADDRESS_STATUS0A, &REG_STATUS0A, 7);
-    dev->interrupta |= REG_INTERRUPTA;
-    dev->interruptb |= REG_INTERRUPTB;    
+    uint8_t i2c_count = dev->i2c_count;
+    uint8_t rx;
+    if (FUSB302_read_status(dev, &rx) != FUSB302_SUCCESS) {
+        return FUSB302_ERR_READ_DEVICE;
+    }
     if (dev->vbus_sense && ((REG_STATUS0 & VBUSOK) == 0)) {
-        /* reset cc pins to pull down */
-        REG_SWITCHES0 = PDWN1 | PDWN2;
-        REG_SWITCHES1 = SPECREV0;
-        REG_MEASURE = 49;
-        REG_WRITE(ADDRESS_SWITCHES0, &REG_SWITCHES0, 3);
-
-        /* turn off internal oscillator */
-        REG_POWER = PWR_BANDGAP | PWR_RECEIVER | PWR_MEASURE;
-        REG_WRITE(ADDRESS_POWER, &REG_POWER, 1);
-
-        /* update state */
-        dev->state = FUSB302_STATE_UNATTACHED;
-        if (events) {
-            *events |= FUSB302_EVENT_DETACHED;
+        return FUSB302_set_detached(dev, events);
+    }
+    if (dev->vbus_sense == 0) {
+        uint8_t detached;
+        if (FUSB302_check_cc_open(dev, &detached) != FUSB302_SUCCESS) {
+            return FUSB302_ERR_READ_DEVICE;
+        }
+        if (detached) {
+            return FUSB302_set_detached(dev, events);
         }
-        return FUSB302_SUCCESS;
     }
-    if (REG_STATUS0A & HARDRST) {
-        uint8_t reg_control = PD_RESET;
-        REG_WRITE(ADDRESS_RESET, &reg_control, 1);
+    if (dev->interrupta & I_HARDRST) {
+        /* messages and events of the previous contract are void */
+        uint8_t reset = PD_RESET, rx_flush = REG_CONTROL1 | RX_FLUSH;
+        dev->interrupta = 0;
+        dev->interruptb = 0;
+        REG_WRITE(ADDRESS_RESET, &reset, 1);
+        REG_WRITE(ADDRESS_CONTROL1, &rx_flush, 1);
+        dev->rx_read = dev->rx_write;
+        dev->event_read = dev->event_write;
+        /* source drives VBUS to vSafe0V and back, stay attached and watch CC level instead */
+        if (FUSB302_set_vbus_sense(dev, 0) != FUSB302_SUCCESS) {
+            return FUSB302_ERR_WRITE_DEVICE;
+        }
+        FUSB302_push_event(dev, events, FUSB302_EVENT_HARD_RESET_RECEIVED);
         return FUSB302_SUCCESS;
     }
-    if (dev->interruptb & I_GCRCSENT) {
-        dev->interruptb &= ~I_GCRCSENT;
-        if (events) {
-            *events |= FUSB302_EVENT_GOOD_CRC_SENT;
+
+    /* transmit results come before any message received in response */
+    if (dev->interrupta & I_HARDSENT) {
+        /* hard reset ordered set is on the wire, reset PD logic */
+        uint8_t reset = PD_RESET;
+        dev->interrupta &= ~I_HARDSENT;
+        REG_WRITE(ADDRESS_RESET, &reset, 1);
+        if (FUSB302_set_vbus_sense(dev, 0) != FUSB302_SUCCESS) {
+            return FUSB302_ERR_WRITE_DEVICE;
         }
+        FUSB302_push_event(dev, events, FUSB302_EVENT_HARD_RESET_SENT);
     }
-    if ((REG_STATUS1 & RX_EMPTY) == 0) {
-        if (FUSB302_read_incoming_packet(dev, events) != FUSB302_SUCCESS) {
-            uint8_t rx_flush = REG_CONTROL1 | RX_FLUSH;
-            reg_write(dev, ADDRESS_CONTROL1, &rx_flush, 1);
+    if (dev->interrupta & I_TXSENT) {
+        dev->interrupta &= ~I_TXSENT;
+        FUSB302_push_event(dev, events, FUSB302_EVENT_TX_SUCCESS);
+    }
+    if (dev->interrupta & I_RETRYFAIL) {
+        dev->interrupta &= ~I_RETRYFAIL;
+        FUSB302_push_event(dev, events, FUSB302_EVENT_TX_FAILED);
+    }
+
+    /* drain rx FIFO, each message is followed by its GoodCRC sent event */
+    for (;;) {
+        FUSB302_rx_msg_t *msg;
+        if (rx == 0) {
+            if ((REG_STATUS1 & RX_EMPTY) || FUSB302_rx_queue_full(dev)) {
+                break;
+            }
+            /* events decoded so far stay queued, run() recovers the bus on error */
+            if (FUSB302_read_incoming_packet(dev, &rx) != FUSB302_SUCCESS) {
+                return FUSB302_ERR_READ_DEVICE;
+            }
+            if (rx == 0) {
+                /* bad packet, drop what is left in the FIFO */
+                if (FUSB302_rx_flush(dev) != FUSB302_SUCCESS) {
+                    return FUSB302_ERR_WRITE_DEVICE;
+                }
+                break;
+            }
+        }
+        msg = &dev->rx_msg[dev->rx_write++ & RX_QUEUE_MASK];
+        dev->rx_i2c_count = dev->i2c_count - i2c_count;
+        FUSB302_push_event(dev, events, FUSB302_EVENT_RX_SOP);
+        if ((msg->header & 0xF01F) != 0x0001) {
+            /* Only messages with valid CRC reach the FIFO, each one except GoodCRC is acknowledged */
+            dev->interruptb &= ~I_GCRCSENT;
+            FUSB302_push_event(dev, events, FUSB302_EVENT_GOOD_CRC_SENT);
+        }
+
+        i2c_count = dev->i2c_count;
+        if (FUSB302_read_status(dev, &rx) != FUSB302_SUCCESS) {
+            return FUSB302_ERR_READ_DEVICE;
         }
     }
-    return FUSB302_SUCCESS;
+    /* CC open debounce in progress, or packets left in FIFO with rx queue full and INT already cleared,
+       call again without waiting for interrupt */
+    return dev->cc_open || (REG_STATUS1 & RX_EMPTY) == 0 ? FUSB302_BUSY : FUSB302_SUCCESS;
 }
 
-FUSB302_ret_t FUSB302_init(FUSB302_dev_t *dev)
+static FUSB302_ret_t FUSB302_check_dev(FUSB302_dev_t *dev)
 {
     if (dev->i2c_address == 0) {
         dev->err_msg = FUSB302_ERR_MSG("Invalid i2c address");
@@ -411,65 +755,132 @@ FUSB302_ret_t FUSB302_init(FUSB302_dev_t *dev)
         dev->err_msg = FUSB302_ERR_MSG("Invalid i2c_write function");
         return FUSB302_ERR_PARAM;
     }
+    if (dev->clock_ms == 0) {
+        dev->err_msg = FUSB302_ERR_MSG("Invalid clock_ms function");
+        return FUSB302_ERR_PARAM;
+    }
 
-    if (reg_read(dev, ADDRESS_DEVICE_ID, &dev->reg_control[1], 1) != FUSB302_SUCCESS) {
+    if (reg_read(dev, ADDRESS_DEVICE_ID, &REG_DEVICE_ID, 1) != FUSB302_SUCCESS) {
         dev->err_msg = FUSB302_ERR_MSG("Device not found");
         return FUSB302_ERR_READ_DEVICE;
     }
 
-	if ((dev->reg_control[1] & 0x80) == 0) {
+	if ((REG_DEVICE_ID & 0x80) == 0) {
         dev->err_msg = FUSB302_ERR_MSG("Invalid device version");
         return FUSB302_ERR_DEVICE_ID;
     }
+    return FUSB302_SUCCESS;
+}
+
+FUSB302_ret_t FUSB302_init(FUSB302_dev_t *dev)
+{
+    FUSB302_ret_t ret = FUSB302_check_dev(dev);
+    if (ret != FUSB302_SUCCESS) {
+        return ret;
+    }
 
     dev->state = FUSB302_STATE_UNATTACHED;
-    dev->rx_header = 0;
-    memset(dev->rx_buffer, 0, sizeof(dev->rx_buffer));
+    dev->rx_read = dev->rx_write = 0;
+    dev->event_read = dev->event_write = 0;
 
     /* restore default settings */
-    REG_RESET = SW_RES;
-    REG_WRITE(ADDRESS_RESET, &REG_RESET, 1);
+    uint8_t reset = SW_RES;
+    REG_WRITE(ADDRESS_RESET, &reset, 1);
     
     /* fetch all R/W registers */
     REG_READ(ADDRESS_DEVICE_ID, &REG_DEVICE_ID, 15);
+    dev->reg_dirty = 0;
 
     /* configure switchs and comparators */
-    REG_SWITCHES0 = PDWN1 | PDWN2;
-    REG_SWITCHES1 = SPECREV0;
-    REG_MEASURE = 49;
-	REG_WRITE(ADDRESS_SWITCHES0, &REG_SWITCHES0, 3);
+    REG_SET(ADDRESS_SWITCHES0, PDWN1 | PDWN2);
+    REG_SET(ADDRESS_SWITCHES1, SPECREV0);
+    REG_SET(ADDRESS_MEASURE, 49);
 
     /* configure auto retries */
-    REG_CONTROL3 &= ~N_RETRIES_MASK;
-    REG_CONTROL3 |= N_RETRIES(3) | AUTO_RETRY;
-    REG_WRITE(ADDRESS_CONTROL3, &REG_CONTROL3, 1);
+    REG_SET(ADDRESS_CONTROL3, (REG_CONTROL3 & ~N_RETRIES_MASK) | N_RETRIES(3) | AUTO_RETRY);
 
     /* configure interrupt mask */
-    REG_MASK = 0xFF;
-    REG_MASK &= ~(M_VBUSOK | M_ACTIVITY | M_COLLISION | M_ALERT | M_CRC_CHK);
-    REG_WRITE(ADDRESS_MASK, &REG_MASK, 1);
+    REG_SET(ADDRESS_MASK, 0xFF & ~(M_VBUSOK | M_ACTIVITY | M_COLLISION | M_ALERT | M_CRC_CHK));
     
     /* configure interrupt maska/maskb */
-    REG_MASKA = 0xFF;
-    REG_MASKA &= ~(M_RETRYFAIL | M_HARDSENT | M_TXSENT | M_HARDRST);
-    REG_WRITE(ADDRESS_MASKA, &REG_MASKA, 1);
-    REG_MASKB = 0xFF;
-    REG_MASKB &= ~(M_GCRCSENT);
-    REG_WRITE(ADDRESS_MASKB, &REG_MASKB, 1);
+    REG_SET(ADDRESS_MASKA, 0xFF & ~(M_RETRYFAIL | M_HARDSENT | M_TXSENT | M_HARDRST | (dev->toggle ? M_TOGDONE : 0)));
+    REG_SET(ADDRESS_MASKB, 0xFF & ~(M_GCRCSENT));
+    REG_COMMIT();
     
-    /* enable interrupt */
-    REG_CONTROL0 &= ~INT_MASK;
-    REG_WRITE(ADDRESS_CONTROL0, &REG_CONTROL0, 1);
+    /* enable interrupt after masks are in place */
+    REG_SET(ADDRESS_CONTROL0, REG_CONTROL0 & ~INT_MASK);
 
     /* Power on, enable VUSB detection */
-    REG_POWER = PWR_BANDGAP | PWR_RECEIVER | PWR_MEASURE;
-    REG_WRITE(ADDRESS_POWER, &REG_POWER, 1);
+    REG_SET(ADDRESS_POWER, PWR_BANDGAP | PWR_RECEIVER | PWR_MEASURE);
+    if (dev->toggle) {
+        /* attach detection as sink by FUSB302, reported by I_TOGDONE */
+        REG_SET(ADDRESS_CONTROL2, (REG_CONTROL2 & ~MODE_MASK) | MODE_UFP | TOGGLE);
+    }
+    REG_COMMIT();
     
     dev->vbus_sense = 1;
+    dev->cc_open = 0;
     dev->err_msg = FUSB302_ERR_MSG("");
 	return FUSB302_SUCCESS;
 }
 
+FUSB302_ret_t FUSB302_resume(FUSB302_dev_t *dev, uint8_t *resumed)
+{
+    /* Attached by a previous MCU run if tx with auto GoodCRC is enabled on one CC pin, the oscillator
+       is on and Rp is still seen on that pin. Otherwise start over with FUSB302_init */
+    uint8_t tx, rx_flush;
+    FUSB302_ret_t ret = FUSB302_check_dev(dev);
+    *resumed = 0;
+    if (ret != FUSB302_SUCCESS) {
+        return ret;
+    }
+    REG_READ(ADDRESS_DEVICE_ID, &REG_DEVICE_ID, 15);
+    REG_READ(ADDRESS_STATUS0A, &REG_STATUS0A, 7);   /* clear interrupts of the previous run */
+    dev->reg_dirty = 0;
+    tx = REG_SWITCHES1 & (TXCC1 | TXCC2);
+    if ((REG_SWITCHES1 & AUTO_CRC) == 0 || (tx != TXCC1 && tx != TXCC2) || (REG_POWER & PWR_INT_OSC) == 0 ||
+            (REG_STATUS0 & (BC_LVL_MASK | ACTIVITY)) == BC_LVL_LT200) {
+        return FUSB302_init(dev);
+    }
+
+    /* messages received while MCU was in reset are not answered, drop them */
+    rx_flush = REG_CONTROL1 | RX_FLUSH;
+    REG_WRITE(ADDRESS_CONTROL1, &rx_flush, 1);
+    dev->rx_read = dev->rx_write = 0;
+    dev->event_read = dev->event_write = 0;
+    dev->interrupta = 0;
+    dev->interruptb = 0;
+    dev->cc1 = tx == TXCC1 ? REG_STATUS0 & BC_LVL_MASK : 0;
+    dev->cc2 = tx == TXCC2 ? REG_STATUS0 & BC_LVL_MASK : 0;
+    dev->vbus_sense = (REG_MASK & M_VBUSOK) == 0;
+    dev->cc_open = 0;
+    dev->state = FUSB302_STATE_ATTACHED;
+    dev->err_msg = FUSB302_ERR_MSG("");
+    *resumed = 1;
+    return FUSB302_SUCCESS;
+}
+
+FUSB302_ret_t FUSB302_restore(FUSB302_dev_t *dev)
+{
+    /* R/W registers except DEVICE_ID and RESET, bit n for address n + 1 */
+    #define REG_RESTORE_MASK    0x77FE
+    uint8_t reg;
+    REG_READ(ADDRESS_DEVICE_ID, &reg, 1);
+    if (reg != REG_DEVICE_ID) {
+        dev->err_msg = FUSB302_ERR_MSG("Invalid device version");
+        return FUSB302_ERR_DEVICE_ID;
+    }
+
+    /* write whole shadow back, device may have missed a write or been reset */
+    dev->reg_dirty |= REG_RESTORE_MASK;
+    REG_COMMIT();
+
+    /* an interrupted FIFO read leaves the FIFO out of step with packet boundaries */
+    reg = REG_CONTROL1 | RX_FLUSH;
+    REG_WRITE(ADDRESS_CONTROL1, &reg, 1);
+    return FUSB302_SUCCESS;
+}
+
 FUSB302_ret_t FUSB302_pd_reset(FUSB302_dev_t *dev)
 {
     uint8_t reg = PD_RESET;
@@ -479,8 +890,8 @@ FUSB302_ret_t FUSB302_pd_reset(FUSB302_dev_t *dev)
 
 FUSB302_ret_t FUSB302_pdwn_cc(FUSB302_dev_t *dev, uint8_t enable)
 {
-    REG_SWITCHES0 = enable ? (PDWN1 | PDWN2) : 0;
-	REG_WRITE(ADDRESS_SWITCHES0, &REG_SWITCHES0, 1);
+    REG_SET(ADDRESS_SWITCHES0, enable ? (PDWN1 | PDWN2) : 0);
+    REG_COMMIT();
     return FUSB302_SUCCESS;
 }
 
@@ -488,16 +899,27 @@ FUSB302_ret_t FUSB302_set_vbus_sense(FUSB302_dev_t *dev, uint8_t enable)
 {
     if (dev->vbus_sense != enable) {
         if (enable) {
-            REG_MASK &= ~M_VBUSOK;  /* enable VBUSOK interrupt */
-        } else { 
-            REG_MASK |= M_VBUSOK;   /* disable VBUSOK interrupt */
+            /* enable VBUSOK interrupt, disable BC_LVL interrupt */
+            REG_SET(ADDRESS_MASK, (REG_MASK & ~M_VBUSOK) | M_BC_LVL);
+        } else {
+            /* disable VBUSOK interrupt, detach is detected by CC level instead */
+            REG_SET(ADDRESS_MASK, (REG_MASK | M_VBUSOK) & ~M_BC_LVL);
         }
-        REG_WRITE(ADDRESS_MASK, &REG_MASK, 1);
+        REG_COMMIT();
         dev->vbus_sense = enable;
+        dev->cc_open = 0;
     }
     return FUSB302_SUCCESS;
 }
 
+FUSB302_ret_t FUSB302_detach(FUSB302_dev_t *dev)
+{
+    if (dev->state != FUSB302_STATE_ATTACHED) {
+        return FUSB302_SUCCESS;
+    }
+    return FUSB302_set_detached(dev, 0);
+}
+
 FUSB302_ret_t FUSB302_get_ID(FUSB302_dev_t *dev, uint8_t * version_ID, uint8_t * revision_ID)
 {
     if (dev && (REG_DEVICE_ID & 0x80)) {
@@ -531,27 +953,119 @@ FUSB302_ret_t FUSB302_get_vbus_level(FUSB302_dev_t *dev, uint8_t *vbus)
 	return FUSB302_SUCCESS;
 }
 
+FUSB302_ret_t FUSB302_get_sink_tx_ok(FUSB302_dev_t *dev, uint8_t *ok)
+{
+    /* BC_LVL is measured on the CC pin used for tx, SinkTxNG (Rp 1.5A) reads below 1.23V */
+    REG_READ(ADDRESS_STATUS0, &REG_STATUS0, 1);
+    *ok = (REG_STATUS0 & (BC_LVL_MASK | ACTIVITY)) == BC_LVL_GT1230;
+    return FUSB302_SUCCESS;
+}
+
+static FUSB302_ret_t vbus_compare(FUSB302_dev_t *dev, uint8_t mdac, uint8_t *above)
+{
+    /* COMP is set if VBUS is higher than (MDAC + 1) * 420mV */
+    REG_SET(ADDRESS_MEASURE, MEAS_VBUS | mdac);
+    REG_COMMIT();
+    REG_READ(ADDRESS_STATUS0, &REG_STATUS0, 1);
+    *above = (REG_STATUS0 & COMP) ? 1 : 0;
+    return FUSB302_SUCCESS;
+}
+
+static FUSB302_ret_t vbus_measure(FUSB302_dev_t *dev, uint8_t mdac, uint8_t *count)
+{
+    /* Measure block is connected to VBUS only if MEAS_CC1 and MEAS_CC2 are cleared. Switches0 and
+       Measure are written in one burst through Switches1, and restored the same way at the end.
+       With mdac > MDAC_MASK, bisection gives count of thresholds VBUS is higher than, 0 to 64 in up to 7
+       compares.
+       Otherwise single compare, count is 1 if VBUS is higher than the threshold of mdac */
+    uint8_t switches0 = REG_SWITCHES0, measure = REG_MEASURE;
+    uint8_t lo = 0, hi = MDAC_MASK + 1, above = 0;
+    FUSB302_ret_t ret;
+    REG_SET(ADDRESS_SWITCHES0, switches0 & ~(MEAS_CC1 | MEAS_CC2));
+    reg_touch(dev, ADDRESS_SWITCHES1);
+    if (mdac <= MDAC_MASK) {
+        ret = vbus_compare(dev, mdac, &above);
+        lo = above;
+    } else {
+        do {
+            uint8_t mid = (lo + hi) >> 1;
+            ret = vbus_compare(dev, mid, &above);
+            if (above) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        } while (lo < hi && ret == FUSB302_SUCCESS);
+    }
+    *count = lo;
+
+    /* restore shadow even on failure, dirty registers are written on next commit */
+    REG_SET(ADDRESS_SWITCHES0, switches0);
+    reg_touch(dev, ADDRESS_SWITCHES1);
+    REG_SET(ADDRESS_MEASURE, measure);
+    if (ret != FUSB302_SUCCESS) {
+        return ret;
+    }
+    REG_COMMIT();
+    return FUSB302_SUCCESS;
+}
+
+FUSB302_ret_t FUSB302_measure_vbus(FUSB302_dev_t *dev, uint16_t *vbus)
+{
+    uint8_t count;
+    FUSB302_ret_t ret = vbus_measure(dev, MDAC_MASK + 1, &count);
+    if (ret == FUSB302_SUCCESS) {
+        *vbus = (uint16_t)count * MDAC_VBUS_MV;
+    }
+    return ret;
+}
+
+FUSB302_ret_t FUSB302_check_vbus(FUSB302_dev_t *dev, uint16_t vbus, uint8_t *reached)
+{
+    /* largest threshold not above vbus */
+    uint16_t n = vbus / MDAC_VBUS_MV;
+    uint8_t mdac = n > MDAC_MASK + 1 ? MDAC_MASK : n ? n - 1 : 0;
+    return vbus_measure(dev, mdac, reached);
+}
+
+uint8_t FUSB302_get_event(FUSB302_dev_t *dev, FUSB302_event_t *event)
+{
+    if (dev->event_read != dev->event_write) {
+        *event = dev->event_queue[dev->event_read++ & EVENT_QUEUE_MASK];
+        return 1;
+    }
+    return 0;
+}
+
 FUSB302_ret_t FUSB302_get_message(FUSB302_dev_t *dev, uint16_t * header, uint32_t * data)
 {
+    FUSB302_rx_msg_t *msg;
+    if (dev->rx_read == dev->rx_write) {
+        dev->err_msg = FUSB302_ERR_MSG("No message received");
+        return FUSB302_ERR_PARAM;
+    }
+    msg = &dev->rx_msg[dev->rx_read++ & RX_QUEUE_MASK];
+    dev->rx_sop = msg->sop;
     if (header) {
-        *header = dev->rx_header;
+        *header = msg->header;
     }
     if (data) {
-        uint8_t len = (dev->rx_header >> 12) & 0x7;
-        memcpy(data, dev->rx_buffer, len * 4);
+        uint8_t len = (msg->header >> 12) & 0x7;
+        memcpy(data, msg->data, len * 4);
     }
 	return FUSB302_SUCCESS;
 }
 
-FUSB302_ret_t FUSB302_tx_sop(FUSB302_dev_t *dev, uint16_t header, const uint32_t *data)
+static FUSB302_ret_t FUSB302_tx(FUSB302_dev_t *dev, uint8_t sync3, uint8_t sync4, uint16_t header, const uint32_t *data)
 {
+    /* Ordered set SOP: Sync-1 Sync-1 Sync-1 Sync-2, SOP': Sync-1 Sync-1 Sync-3 Sync-3 */
     uint8_t buf[40];
     uint8_t * pbuf = buf;
     uint8_t obj_count = ((header >> 12) & 7);
     *pbuf++ = (uint8_t)TX_TOKEN_SOP1;
     *pbuf++ = (uint8_t)TX_TOKEN_SOP1;
-    *pbuf++ = (uint8_t)TX_TOKEN_SOP1;
-    *pbuf++ = (uint8_t)TX_TOKEN_SOP2;
+    *pbuf++ = sync3;
+    *pbuf++ = sync4;
     *pbuf++ = (uint8_t)TX_TOKEN_PACKSYM | ((obj_count << 2) + 2);
     *pbuf++ = header & 0xFF; header >>= 8;
     *pbuf++ = header & 0xFF;
@@ -567,18 +1081,33 @@ FUSB302_ret_t FUSB302_tx_sop(FUSB302_dev_t *dev, uint16_t header, const uint32_t
     *pbuf++ = (uint8_t)TX_TOKEN_TXOFF;
     *pbuf++ = (uint8_t)TX_TOKEN_TXON;
     REG_WRITE(ADDRESS_FIFOS, buf, pbuf - buf);
-    dev->delay_ms(1);
+    /* completion is reported by FUSB302_EVENT_TX_SUCCESS or FUSB302_EVENT_TX_FAILED */
 	return FUSB302_SUCCESS;
 }
 
+FUSB302_ret_t FUSB302_tx_sop(FUSB302_dev_t *dev, uint16_t header, const uint32_t *data)
+{
+    return FUSB302_tx(dev, TX_TOKEN_SOP1, TX_TOKEN_SOP2, header, data);
+}
+
+FUSB302_ret_t FUSB302_tx_sop_prime(FUSB302_dev_t *dev, uint16_t header, const uint32_t *data)
+{
+    return FUSB302_tx(dev, TX_TOKEN_SOP3, TX_TOKEN_SOP3, header, data);
+}
+
+FUSB302_ret_t FUSB302_set_sop_prime(FUSB302_dev_t *dev, uint8_t enable)
+{
+    REG_SET(ADDRESS_CONTROL1, enable ? (REG_CONTROL1 | ENSOP1) : (REG_CONTROL1 & ~ENSOP1));
+    REG_COMMIT();
+    return FUSB302_SUCCESS;
+}
+
 FUSB302_ret_t FUSB302_tx_hard_reset(FUSB302_dev_t *dev)
 {
     uint8_t reg_control = REG_CONTROL3;
     reg_control |= SEND_HARDRESET;
     REG_WRITE(ADDRESS_CONTROL3, &reg_control, 1);
-    dev->delay_ms(5);
-    reg_control = PD_RESET;
-    REG_WRITE(ADDRESS_RESET, &reg_control, 1);
+    /* PD logic is reset when I_HARDSENT is received, see FUSB302_EVENT_HARD_RESET_SENT */
     return FUSB302_SUCCESS;
 }
 
@@ -586,6 +1115,9 @@ FUSB302_ret_t FUSB302_alert(FUSB302_dev_t *dev, FUSB302_event_t * events)
 {
     FUSB302_ret_t (* const handler[]) (FUSB302_dev_t *, FUSB302_event_t *) = {
         FUSB302_state_unattached,
+        FUSB302_state_attaching,    /* FUSB302_STATE_ATTACH_CC1 */
+        FUSB302_state_attaching,    /* FUSB302_STATE_ATTACH_CC2 */
+        FUSB302_state_attaching,    /* FUSB302_STATE_ATTACH_DONE */
         FUSB302_state_attached
     };
     if (dev->state < sizeof(handler) / sizeof(handler[0])) {
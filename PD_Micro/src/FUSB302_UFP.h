@@ -11,7 +11,8 @@
  *
  * FUSB302 can support PD3.0 with limitations and workarounds
  * - Do not have enough FIFO for unchunked message, use chunked message instead
- * - VBUS sense low threshold at 4V, disable vbus_sense if request PPS below 4V
+ * - VBUS sense low threshold at 4V, disable vbus_sense if request PPS below 4V,
+ *   detach is then detected by CC level and MDAC VBUS threshold
  * 
  */
 
@@ -34,20 +35,54 @@ typedef uint8_t FUSB302_ret_t;
 #define FUSB302_EVENT_DETACHED          (1 << 1)
 #define FUSB302_EVENT_RX_SOP            (1 << 2)
 #define FUSB302_EVENT_GOOD_CRC_SENT     (1 << 3)
+#define FUSB302_EVENT_TX_SUCCESS        (1 << 4)    /* GoodCRC received for transmitted message */
+#define FUSB302_EVENT_TX_FAILED         (1 << 5)    /* No GoodCRC after all retries */
+#define FUSB302_EVENT_HARD_RESET_SENT   (1 << 6)
+#define FUSB302_EVENT_HARD_RESET_RECEIVED (1 << 7)  /* PD logic reset, VBUS sense disabled while source cycles VBUS */
 typedef uint8_t FUSB302_event_t;
 
+enum {                                      /* SOP* packet type */
+    FUSB302_SOP                 = 0,
+    FUSB302_SOP_PRIME           = 1,        /* cable plug at the far end from the VCONN source */
+    FUSB302_SOP_DPRIME          = 2
+};
+
+#define FUSB302_RX_QUEUE_SIZE       4       /* array size must be power of 2 and <=128 */
+#define FUSB302_EVENT_QUEUE_SIZE    16      /* array size must be power of 2 and <=128 */
+
+typedef struct {
+    uint16_t header;
+    uint8_t sop;                    /* FUSB302_SOP, FUSB302_SOP_PRIME or FUSB302_SOP_DPRIME */
+    uint8_t data[7 * 4];
+} FUSB302_rx_msg_t;
+
+/* Return updated byte count of a burst read from the bytes received so far */
+typedef uint8_t (*FUSB302_burst_len_t)(const uint8_t *data, uint8_t received, uint8_t count);
+
 typedef struct {
     /* setup by user */
     uint8_t i2c_address;
-    FUSB302_ret_t (*i2c_read)(uint8_t dev_addr, uint8_t reg_addr, uint8_t *data, uint8_t count);
-    FUSB302_ret_t (*i2c_write)(uint8_t dev_addr, uint8_t reg_addr, uint8_t *data, uint8_t count);
-    FUSB302_ret_t (*delay_ms)(uint32_t t);
+    void *context;                  /* passed to callbacks, e.g. bus of this device */
+    FUSB302_ret_t (*i2c_read)(void *context, uint8_t dev_addr, uint8_t reg_addr, uint8_t *data, uint8_t count);
+    FUSB302_ret_t (*i2c_write)(void *context, uint8_t dev_addr, uint8_t reg_addr, uint8_t *data, uint8_t count);
+    FUSB302_ret_t (*delay_ms)(void *context, uint32_t t);
+    uint16_t (*clock_ms)(void);     /* free running millisecond clock, wrap around */
+    /* optional, single read transaction whose count is extended by burst_len while receiving */
+    FUSB302_ret_t (*i2c_read_burst)(void *context, uint8_t dev_addr, uint8_t reg_addr, uint8_t *data, uint8_t count,
+        FUSB302_burst_len_t burst_len);
+    /* optional, attach detected by FUSB302 SNK toggle and I_TOGDONE, call FUSB302_alert on INT only */
+    uint8_t toggle;
 
     /* used by this library */
     const char * err_msg;
-    uint16_t rx_header;
-    uint8_t rx_buffer[32];
+    FUSB302_rx_msg_t rx_msg[FUSB302_RX_QUEUE_SIZE];
+    uint8_t rx_read;
+    uint8_t rx_write;
+    FUSB302_event_t event_queue[FUSB302_EVENT_QUEUE_SIZE];
+    uint8_t event_read;
+    uint8_t event_write;
     uint8_t reg_control[15];
+    uint16_t reg_dirty;     /* bit n set if reg_control[n] is not written to device yet */
     uint8_t reg_status[7];
     
     uint8_t interrupta;
@@ -56,20 +91,53 @@ typedef struct {
     uint8_t cc2;
     uint8_t state;
     uint8_t vbus_sense;
+    uint16_t time_attach;
+    uint16_t time_toggle_done;  /* I_TOGDONE, VBUS is awaited for up to tVBUSON */
+    uint8_t cc_last;
+    uint8_t cc_count;
+    uint8_t cc_open;        /* CC open seen while vbus_sense is disabled, debounce from time_cc_open, 2 after VBUS check */
+    uint16_t time_cc_open;
+    uint8_t i2c_count;      /* I2C transactions, wrap around */
+    uint8_t rx_i2c_count;   /* I2C transactions used to fetch the last received message */
+    uint8_t rx_sop;         /* SOP* type of the last message from FUSB302_get_message */
+    uint8_t i2c_err_count;  /* failed I2C transactions, wrap around */
 } FUSB302_dev_t;
 
 static inline const char * FUSB302_get_last_err_msg(FUSB302_dev_t *dev) { return dev->err_msg; }
+static inline uint8_t FUSB302_get_rx_i2c_count(FUSB302_dev_t *dev) { return dev->rx_i2c_count; }
+static inline uint8_t FUSB302_get_i2c_err_count(FUSB302_dev_t *dev) { return dev->i2c_err_count; }
+static inline uint8_t FUSB302_get_rx_sop(FUSB302_dev_t *dev) { return dev->rx_sop; }
 
 FUSB302_ret_t FUSB302_init            (FUSB302_dev_t *dev);
+/* Take over an attached FUSB302 without reset, e.g. after MCU reset, resumed is 0 if FUSB302_init was done instead */
+FUSB302_ret_t FUSB302_resume          (FUSB302_dev_t *dev, uint8_t *resumed);
+/* Write register shadow back to device and flush rx FIFO, e.g. after I2C bus recovery */
+FUSB302_ret_t FUSB302_restore         (FUSB302_dev_t *dev);
 FUSB302_ret_t FUSB302_pd_reset        (FUSB302_dev_t *dev);
 FUSB302_ret_t FUSB302_pdwn_cc         (FUSB302_dev_t *dev, uint8_t enable);
 FUSB302_ret_t FUSB302_set_vbus_sense  (FUSB302_dev_t *dev, uint8_t enable);
+/* Force unattached state and queue FUSB302_EVENT_DETACHED, e.g. when the partner stops responding */
+FUSB302_ret_t FUSB302_detach          (FUSB302_dev_t *dev);
 FUSB302_ret_t FUSB302_get_ID          (FUSB302_dev_t *dev, uint8_t *version_ID, uint8_t *revision_ID);
 FUSB302_ret_t FUSB302_get_cc          (FUSB302_dev_t *dev, uint8_t *cc1, uint8_t *cc2);
 FUSB302_ret_t FUSB302_get_vbus_level  (FUSB302_dev_t *dev, uint8_t *vbus);
+/* PD3.0 collision avoidance, ok is 1 if source presents SinkTxOk (Rp 3.0A) and the line is idle */
+FUSB302_ret_t FUSB302_get_sink_tx_ok  (FUSB302_dev_t *dev, uint8_t *ok);
+/* Measure VBUS by MDAC comparator bisection, vbus is the lower bound in mV of a 420mV step up to 26.88V,
+   13 or 15 I2C transactions.
+   Check VBUS is higher than vbus in mV rounded down to a 420mV step, 3 I2C transactions */
+FUSB302_ret_t FUSB302_measure_vbus    (FUSB302_dev_t *dev, uint16_t *vbus);
+FUSB302_ret_t FUSB302_check_vbus      (FUSB302_dev_t *dev, uint16_t vbus, uint8_t *reached);
+/* Events and messages are queued in received order, each FUSB302_EVENT_RX_SOP has one message */
+uint8_t       FUSB302_get_event       (FUSB302_dev_t *dev, FUSB302_event_t *event);
 FUSB302_ret_t FUSB302_get_message     (FUSB302_dev_t *dev, uint16_t *header, uint32_t *data);
 FUSB302_ret_t FUSB302_tx_sop          (FUSB302_dev_t *dev, uint16_t header, const uint32_t *data);
+/* SOP' to the cable e-marker. SOP' messages are received only while enabled, GoodCRC is sent for them */
+FUSB302_ret_t FUSB302_tx_sop_prime    (FUSB302_dev_t *dev, uint16_t header, const uint32_t *data);
+FUSB302_ret_t FUSB302_set_sop_prime   (FUSB302_dev_t *dev, uint8_t enable);
 FUSB302_ret_t FUSB302_tx_hard_reset   (FUSB302_dev_t *dev);
+/* Return FUSB302_BUSY if attach detection is in progress, or if the rx queue is full with packets left in
+   FUSB302 RX FIFO. Read events and messages, then call again without waiting for interrupt */
 FUSB302_ret_t FUSB302_alert           (FUSB302_dev_t *dev, FUSB302_event_t *events);
 
 #endif /* FUSB302_H */
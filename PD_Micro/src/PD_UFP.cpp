@@ -22,6 +22,13 @@
 #define t_TypeCSinkWaitCap      350
 #define t_RequestToPSReady      580     // combine t_SenderResponse and t_PSTransition
 #define t_PPSRequest            5000    // must less than 10000 (10s)
+#define t_VBUSReady             50      // VBUS should be at new voltage when PS_RDY is received
+#define t_SinkTxDefer           500     // send anyway if SinkTxOk is not seen, PPS expires after 10s
+#define t_HardResetRecover      2000    // t_Safe0V + t_SrcRecover + t_SrcTurnOn, source cycles VBUS
+#define t_EPRKeepAlive          375     // t_SinkEPRKeepAlive 250 - 500ms, source exits EPR mode after 1s
+#define t_VDMSenderResponse     30      // 24 - 30ms, no answer from cable e-marker
+#define t_I2CTimeout            10      // bound of a single I2C transaction
+#define N_I2C_BACKOFF_MAX       7       // back off 2, 4 ... 128ms after consecutive I2C faults
 
 #define PIN_OUTPUT_ENABLE       10
 #define PIN_FUSB302_INT         7
@@ -40,17 +47,44 @@ enum {
     STATUS_LOG_CC,
     STATUS_LOG_SRC_CAP,
     STATUS_LOG_POWER_READY,
+    STATUS_LOG_VBUS_TIMEOUT,
     STATUS_LOG_POWER_PPS_STARTUP,
     STATUS_LOG_POWER_REJECT,
     STATUS_LOG_LOAD_SW_ON,
     STATUS_LOG_LOAD_SW_OFF,
+    STATUS_LOG_HARD_RESET,
+    STATUS_LOG_EPR_MODE,
+    STATUS_LOG_CABLE,
+    STATUS_LOG_ALERT,
+    STATUS_LOG_STATUS,
 };
 
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////
 // PD_UFP_core_c
 ///////////////////////////////////////////////////////////////////////////////////////////////////
+// Power status kept across MCU reset for warm start, one entry per FUSB302 address 0x22 to 0x25
+struct PD_UFP_snapshot_t {
+    uint16_t voltage;
+    uint16_t current;
+    status_power_t status;
+    uint8_t check;
+};
+
+static PD_UFP_snapshot_t PD_UFP_snapshot[4] __attribute__((section(".noinit")));
+
+static uint8_t PD_UFP_snapshot_check(const PD_UFP_snapshot_t * s)
+{
+    // Random RAM content after power on fails the check
+    return 0xA5 ^ s->status ^ (s->voltage >> 8) ^ s->voltage ^ (s->current >> 8) ^ s->current;
+}
+
 PD_UFP_core_c::PD_UFP_core_c():
+    pin_int(PIN_FUSB302_INT),
+#if !PD_UFP_TWI_ENABLE
+    wire(&Wire),
+#endif
+    port_next(0),
     ready_voltage(0),
     ready_current(0),
     PPS_voltage_next(0),
@@ -62,14 +96,55 @@ PD_UFP_core_c::PD_UFP_core_c():
     time_wait_src_cap(0),
     time_wait_ps_rdy(0),
     time_PPS_request(0),
+    time_wait_vbus(0),
+    time_hard_reset(0),
+    time_sink_tx(0),
+    time_EPR_keepalive(0),
+    time_wait_cable(0),
     get_src_cap_retry_count(0),
     wait_src_cap(0),
+    wait_hard_reset(0),
+    wait_sink_tx(0),
     wait_ps_rdy(0),
-    send_request(0)
+    send_request(0),
+    PPS_keepalive(0),
+    send_EPR_mode(0),
+    send_get_status(0),
+    cable_discovery(0),
+    send_cable_discovery(0),
+    wait_cable(0),
+    tx_sop_prime(0),
+    vbus_check(0),
+    wait_vbus(STATUS_POWER_NA),
+    wait_vbus_voltage(0),
+    wait_vbus_current(0),
+    FUSB302_busy(0),
+    i2c_fail_count(0),
+    time_i2c_fail(0),
+    i2c_recover_count(0),
+    status_attached(0),
+    int_wakeup(0),
+    int_pending(0),
+    warm_start(0)
 {
     memset(&FUSB302, 0, sizeof(FUSB302_dev_t));
     memset(&protocol, 0, sizeof(PD_protocol_t));
+    FUSB302.i2c_address = 0x22;
+}
+
+void PD_UFP_core_c::set_port(uint8_t i2c_address, uint8_t pin_int)
+{
+    FUSB302.i2c_address = i2c_address;
+    this->pin_int = pin_int;
+}
+
+#if !PD_UFP_TWI_ENABLE
+void PD_UFP_core_c::set_port(TwoWire & wire, uint8_t i2c_address, uint8_t pin_int)
+{
+    this->wire = &wire;
+    set_port(i2c_address, pin_int);
 }
+#endif
 
 void PD_UFP_core_c::init(enum PD_power_option_t power_option)
 {
@@ -78,18 +153,38 @@ void PD_UFP_core_c::init(enum PD_power_option_t power_option)
 
 void PD_UFP_core_c::init_PPS(uint16_t PPS_voltage, uint8_t PPS_current, enum PD_power_option_t power_option)
 {
+    // Register port for run_all() and interrupt wakeup
+    PD_UFP_core_c ** port = &port_list;
+    while (*port && *port != this) {
+        port = &(*port)->port_next;
+    }
+    *port = this;
+
     // Initialize FUSB302
-    pinMode(PIN_FUSB302_INT, INPUT_PULLUP); // Set FUSB302 int pin input ant pull up
-    FUSB302.i2c_address = 0x22;
+    pinMode(pin_int, INPUT_PULLUP); // Set FUSB302 int pin input ant pull up
+    i2c_setup();
+    FUSB302.context = this;
     FUSB302.i2c_read = FUSB302_i2c_read;
     FUSB302.i2c_write = FUSB302_i2c_write;
     FUSB302.delay_ms = FUSB302_delay_ms;
-    if (FUSB302_init(&FUSB302) == FUSB302_SUCCESS && FUSB302_get_ID(&FUSB302, 0, 0) == FUSB302_SUCCESS) {
+    FUSB302.clock_ms = FUSB302_clock_ms;
+#if PD_UFP_TWI_ENABLE
+    // Single transaction status and FIFO read needs the length extended while receiving, TWI only.
+    // Wire reads status, packet header and payload in 3 transactions
+    FUSB302.i2c_read_burst = FUSB302_i2c_read_burst;
+#endif
+    uint8_t resumed = 0;
+    FUSB302_ret_t ret = warm_start ? FUSB302_resume(&FUSB302, &resumed) : FUSB302_init(&FUSB302);
+    if (ret == FUSB302_SUCCESS && FUSB302_get_ID(&FUSB302, 0, 0) == FUSB302_SUCCESS) {
         status_initialized = 1;
     }
+    const PD_UFP_snapshot_t * snapshot = &PD_UFP_snapshot[FUSB302.i2c_address & 3];
+    if (!resumed || snapshot->check != PD_UFP_snapshot_check(snapshot)) {
+        snapshot = 0;
+    }
 
-    // Two stage startup for PPS Voltge < 5V
-    if (PPS_voltage && PPS_voltage < PPS_V(5.0)) {
+    // Two stage startup for PPS Voltge < 5V, not needed if PPS contract is resumed
+    if (PPS_voltage && PPS_voltage < PPS_V(5.0) && !(snapshot && snapshot->status == STATUS_POWER_PPS)) {
         PPS_voltage_next = PPS_voltage;
         PPS_current_next = PPS_current;
         PPS_voltage = PPS_V(5.0);
@@ -101,19 +196,106 @@ void PD_UFP_core_c::init_PPS(uint16_t PPS_voltage, uint8_t PPS_current, enum PD_
     PD_protocol_set_PPS(&protocol, PPS_voltage, PPS_current, false);
 
     status_log_event(STATUS_LOG_DEV);
+    if (resumed) {
+        if (snapshot && snapshot->status != STATUS_POWER_NA) {
+            status_power_ready(snapshot->status, snapshot->voltage, snapshot->current);
+            status_log_event(STATUS_LOG_POWER_READY);
+        }
+        resume();
+    }
+}
+
+void PD_UFP_core_c::init_AVS(uint16_t AVS_voltage, uint8_t AVS_current, enum PD_power_option_t power_option)
+{
+    // Source_Capabilities is evaluated when it arrives, after the AVS setting
+    init_PPS(0, 0, power_option);
+    PD_protocol_set_AVS(&protocol, AVS_voltage, AVS_current, false);
+}
+
+void PD_UFP_core_c::resume(void)
+{
+    // FUSB302 kept the contract, fetch source capabilities to rebuild protocol state without reset
+    uint16_t header;
+    status_attached = 1;
+    wait_src_cap = 1;
+    time_wait_src_cap = time_PPS_request = clock_ms();
+    PD_protocol_create_get_src_cap(&protocol, &header);
+    status_log_event(STATUS_LOG_MSG_TX);
+    FUSB302_tx_sop(&FUSB302, header, 0);
 }
 
 void PD_UFP_core_c::run(void)
 {
-    if (timer() || digitalRead(PIN_FUSB302_INT) == 0) {
-        FUSB302_event_t FUSB302_events = 0;
-        for (uint8_t i = 0; i < 3 && FUSB302_alert(&FUSB302, &FUSB302_events) != FUSB302_SUCCESS; i++) {}
-        if (FUSB302_events) {
-            handle_FUSB302_event(FUSB302_events);
+    bool service;
+    if (i2c_fail_count && (uint16_t)(clock_ms() - time_i2c_fail) < ((uint16_t)1 << i2c_fail_count)) {
+        return;     // Back off after I2C fault
+    }
+    if (int_wakeup) {
+        // Policy timers and attach polling run only while armed, FUSB302 interrupts are latched by ISR.
+        // Take the latch with interrupts off so an edge in between is not lost, and check the pin level as
+        // FUSB302 holds INT low until read without a new falling edge
+        noInterrupts();
+        service = int_pending;
+        int_pending = 0;
+        interrupts();
+        service = service || digitalRead(pin_int) == 0 || FUSB302_busy;
+        if (timer_armed()) {
+            service = timer() || service;
+        }
+    } else {
+        // Polling is not needed while FUSB302 toggles for attach
+        service = (timer() && (status_attached || !FUSB302.toggle)) || digitalRead(pin_int) == 0 || FUSB302_busy;
+    }
+    if (service) {
+        FUSB302_event_t FUSB302_event = 0;
+        FUSB302_ret_t ret = FUSB302_alert(&FUSB302, 0);
+        if (ret & (FUSB302_ERR_READ_DEVICE | FUSB302_ERR_WRITE_DEVICE)) {
+            i2c_recover();
+            FUSB302_busy = 1;   // Service again after back off
+        } else {
+            i2c_fail_count = 0;
+            FUSB302_busy = ret == FUSB302_BUSY;   // Attach detection in progress, continue on next run
+        }
+        /* Handle one event at a time in the order they occurred */
+        while (FUSB302_get_event(&FUSB302, &FUSB302_event)) {
+            handle_FUSB302_event(FUSB302_event);
+        }
+    }
+}
+
+PD_UFP_core_c * PD_UFP_core_c::port_list = 0;
+
+void PD_UFP_core_c::run_all(void)
+{
+    for (PD_UFP_core_c * port = port_list; port; port = port->port_next) {
+        port->run();
+    }
+}
+
+void PD_UFP_core_c::FUSB302_int_isr(void)
+{
+    // Shared by all ports, latch the ports whose INT pin is asserted
+    for (PD_UFP_core_c * port = port_list; port; port = port->port_next) {
+        if (port->int_wakeup && digitalRead(port->pin_int) == 0) {
+            port->int_pending = 1;
         }
     }
 }
 
+void PD_UFP_core_c::int_wakeup_set(bool enable)
+{
+    // PD Micro INT pin 7 is INT6 on ATmega32U4, FUSB302 holds INT low until interrupts are read
+    uint8_t irq = digitalPinToInterrupt(pin_int);
+    if (enable) {
+        int_pending = 1;
+        int_wakeup = 1;
+        attachInterrupt(irq, FUSB302_int_isr, FALLING);
+    } else {
+        detachInterrupt(irq);
+        int_wakeup = 0;
+    }
+}
+
 bool PD_UFP_core_c::set_PPS(uint16_t PPS_voltage, uint8_t PPS_current)
 {
     if (status_power == STATUS_POWER_PPS && PD_protocol_set_PPS(&protocol, PPS_voltage, PPS_current, true)) {
@@ -123,6 +305,15 @@ bool PD_UFP_core_c::set_PPS(uint16_t PPS_voltage, uint8_t PPS_current)
     return false;
 }
 
+bool PD_UFP_core_c::set_AVS(uint16_t AVS_voltage, uint8_t AVS_current)
+{
+    if (status_power == STATUS_POWER_AVS && PD_protocol_set_AVS(&protocol, AVS_voltage, AVS_current, true)) {
+        send_request = 1;
+        return true;
+    }
+    return false;
+}
+
 void PD_UFP_core_c::set_power_option(enum PD_power_option_t power_option)
 {
     if (PD_protocol_set_power_option(&protocol, power_option)) {
@@ -130,48 +321,225 @@ void PD_UFP_core_c::set_power_option(enum PD_power_option_t power_option)
     }
 }
 
+void PD_UFP_core_c::set_power_policy(const PD_power_policy_t & policy)
+{
+    if (PD_protocol_set_power_policy(&protocol, &policy)) {
+        send_request = 1;
+    }
+}
+
+void PD_UFP_core_c::status_alert(uint8_t alert)
+{
+    // Source limits current to the request in PPS current limit mode, step it down by 1/4 (at least 50mA)
+    // to the 1A floor of PPS current limit
+    if ((alert & (PD_ALERT_OCP | PD_ALERT_OTP | PD_ALERT_OPERATING_CHANGE)) && status_power == STATUS_POWER_PPS) {
+        uint8_t i = PD_protocol_get_PPS_current(&protocol), next = i - (i + 3) / 4;
+        if (next < PPS_A(1.0)) {
+            next = PPS_A(1.0);
+        }
+        if (next < i && PD_protocol_set_PPS(&protocol, PD_protocol_get_PPS_voltage(&protocol), next, true)) {
+            send_request = 1;
+        }
+    }
+}
+
+void PD_UFP_core_c::cable_discovery_set(bool enable)
+{
+    // Any Type-C cable carries 3A, PDOs above it are requested at 3A until the e-marker reports 5A
+    cable_discovery = enable;
+    send_cable_discovery = enable && status_power != STATUS_POWER_NA;
+    if (wait_cable && !enable) {
+        wait_cable = 0;
+        tx_sop_prime = 0;
+        FUSB302_set_sop_prime(&FUSB302, 0);
+    }
+    if (PD_protocol_set_cable_current(&protocol, enable ? PD_A(3.0) : 0)) {
+        send_request = 1;
+    }
+}
+
+void PD_UFP_core_c::cable_discovered(void)
+{
+    // Answered, NAKed, timed out or no e-marker, stop receiving SOP'
+    wait_cable = 0;
+    tx_sop_prime = 0;
+    cable_discovery = 2;
+    FUSB302_set_sop_prime(&FUSB302, 0);
+    if (PD_protocol_set_cable_current(&protocol, PD_protocol_get_cable_current(&protocol))) {
+        send_request = 1;
+    }
+    status_log_event(STATUS_LOG_CABLE);
+}
+
 void PD_UFP_core_c::clock_prescale_set(uint8_t prescaler)
 {
     if (prescaler) {
         clock_prescaler = prescaler;
+        i2c_setup();    // Keep SCL frequency when CPU clock is prescaled
+    }
+}
+
+void PD_UFP_core_c::i2c_clock_set(PD_UFP_I2C_clock_t clock)
+{
+    i2c_clock = clock;
+    i2c_setup();
+}
+
+void PD_UFP_core_c::i2c_setup(void)
+{
+    const uint32_t freq[3] = {100000, 400000, 1000000};
+    uint32_t scl = freq[i2c_clock < 3 ? i2c_clock : 0];
+#if PD_UFP_TWI_ENABLE
+    PD_UFP_TWI_init(F_CPU / clock_prescaler, scl);
+#else
+    // Wire calculates bit rate from F_CPU, compensate for prescaler and limit to the fastest rate
+    uint32_t max = F_CPU / 16;
+    scl *= clock_prescaler;
+    if (scl > max) {
+        scl = max;
+    }
+    Wire.setClock(scl);
+#if defined(WIRE_HAS_TIMEOUT)
+    Wire.setWireTimeout(t_I2CTimeout * 1000UL / clock_prescaler, true);
+#endif
+    for (PD_UFP_core_c * port = port_list; port; port = port->port_next) {
+        if (port->wire != &Wire) {
+            port->wire->setClock(scl);
+        }
+    }
+#endif
+}
+
+void PD_UFP_core_c::i2c_recover(void)
+{
+    if (i2c_fail_count < N_I2C_BACKOFF_MAX) {
+        i2c_fail_count++;
+    }
+    time_i2c_fail = clock_ms();
+    i2c_recover_count++;
+#if PD_UFP_TWI_ENABLE
+    PD_UFP_TWI_reset();
+#else
+    if (wire != &Wire) {
+        // Bus pins unknown, restart the bus driver only
+        wire->end();
+        wire->begin();
+        i2c_setup();
+        FUSB302_restore(&FUSB302);
+        return;
+    }
+    Wire.end();
+#endif
+    // A slave stuck in the middle of a read holds SDA low, clock SCL until SDA is released and
+    // send STOP. Lines are open drain, driven low or released to pull up
+    pinMode(SDA, INPUT_PULLUP);
+    pinMode(SCL, INPUT_PULLUP);
+    for (uint8_t i = 0; i < 9 && digitalRead(SDA) == LOW; i++) {
+        digitalWrite(SCL, LOW);
+        pinMode(SCL, OUTPUT);
+        delayMicroseconds(5);
+        pinMode(SCL, INPUT_PULLUP);
+        delayMicroseconds(5);
+    }
+    digitalWrite(SDA, LOW);
+    pinMode(SDA, OUTPUT);
+    delayMicroseconds(5);
+    pinMode(SDA, INPUT_PULLUP);
+    delayMicroseconds(5);
+#if !PD_UFP_TWI_ENABLE
+    Wire.begin();
+#endif
+    i2c_setup();
+    // Write register shadow back, retried on next fault if it fails again
+    FUSB302_restore(&FUSB302);
+}
+
+#if PD_UFP_TWI_ENABLE
+FUSB302_ret_t PD_UFP_core_c::FUSB302_i2c_read(void *context, uint8_t dev_addr, uint8_t reg_addr, uint8_t *data, uint8_t count)
+{
+    // FUSB302 driver is synchronous, run() waits on descriptor while TWI interrupt moves the bytes
+    return FUSB302_i2c_read_burst(context, dev_addr, reg_addr, data, count, 0);
+}
+
+static uint8_t twi_wait(PD_UFP_TWI_xfer_t * xfer)
+{
+    // Bounded wait, a stuck bus aborts the queue instead of hanging the board
+    uint16_t t = millis();
+    while (PD_UFP_TWI_is_pending(xfer)) {
+        if ((uint16_t)((uint16_t)millis() - t) > t_I2CTimeout) {
+            PD_UFP_TWI_reset();
+        }
     }
+    return xfer->status;
 }
 
-FUSB302_ret_t PD_UFP_core_c::FUSB302_i2c_read(uint8_t dev_addr, uint8_t reg_addr, uint8_t *data, uint8_t count)
+FUSB302_ret_t PD_UFP_core_c::FUSB302_i2c_read_burst(void *context, uint8_t dev_addr, uint8_t reg_addr, uint8_t *data, uint8_t count,
+    FUSB302_burst_len_t burst_len)
+{
+    PD_UFP_TWI_xfer_t xfer = {dev_addr, reg_addr, PD_UFP_TWI_READ, count, data, 0, burst_len, 0, PD_UFP_TWI_DONE};
+    if (PD_UFP_TWI_submit(&xfer) == 0) {
+        return FUSB302_BUSY;
+    }
+    return twi_wait(&xfer) == PD_UFP_TWI_DONE ? FUSB302_SUCCESS : FUSB302_ERR_READ_DEVICE;
+}
+
+FUSB302_ret_t PD_UFP_core_c::FUSB302_i2c_write(void *context, uint8_t dev_addr, uint8_t reg_addr, uint8_t *data, uint8_t count)
+{
+    PD_UFP_TWI_xfer_t xfer = {dev_addr, reg_addr, PD_UFP_TWI_WRITE, count, data, 0, 0, 0, PD_UFP_TWI_DONE};
+    if (PD_UFP_TWI_submit(&xfer) == 0) {
+        return FUSB302_BUSY;
+    }
+    return twi_wait(&xfer) == PD_UFP_TWI_DONE ? FUSB302_SUCCESS : FUSB302_ERR_WRITE_DEVICE;
+}
+#else
+FUSB302_ret_t PD_UFP_core_c::FUSB302_i2c_read(void *context, uint8_t dev_addr, uint8_t reg_addr, uint8_t *data, uint8_t count)
 {
-    Wire.beginTransmission(dev_addr);
-    Wire.write(reg_addr);
-    Wire.endTransmission();
-    Wire.requestFrom(dev_addr, count);
-    while (Wire.available() && count > 0) {
-        *data++ = Wire.read();
+    TwoWire * wire = ((PD_UFP_core_c *)context)->wire;
+    wire->beginTransmission(dev_addr);
+    wire->write(reg_addr);
+    if (wire->endTransmission() != 0) {
+        return FUSB302_ERR_READ_DEVICE;     // NACK, bus error or timeout
+    }
+    wire->requestFrom(dev_addr, count);
+    while (wire->available() && count > 0) {
+        *data++ = wire->read();
         count--;
     }
     return count == 0 ? FUSB302_SUCCESS : FUSB302_ERR_READ_DEVICE;
 }
 
-FUSB302_ret_t PD_UFP_core_c::FUSB302_i2c_write(uint8_t dev_addr, uint8_t reg_addr, uint8_t *data, uint8_t count)
+FUSB302_ret_t PD_UFP_core_c::FUSB302_i2c_write(void *context, uint8_t dev_addr, uint8_t reg_addr, uint8_t *data, uint8_t count)
 {
-    Wire.beginTransmission(dev_addr);
-    Wire.write(reg_addr);
+    TwoWire * wire = ((PD_UFP_core_c *)context)->wire;
+    wire->beginTransmission(dev_addr);
+    wire->write(reg_addr);
     while (count > 0) {
-        Wire.write(*data++);
+        if (wire->write(*data++) == 0) {
+            return FUSB302_ERR_WRITE_DEVICE;    // Exceed Wire buffer, nothing is sent
+        }
         count--;
     }
-    Wire.endTransmission();
-    return FUSB302_SUCCESS;
+    return wire->endTransmission() == 0 ? FUSB302_SUCCESS : FUSB302_ERR_WRITE_DEVICE;
 }
+#endif
 
-FUSB302_ret_t PD_UFP_core_c::FUSB302_delay_ms(uint32_t t)
+FUSB302_ret_t PD_UFP_core_c::FUSB302_delay_ms(void *context, uint32_t t)
 {
     delay(t / clock_prescaler);
     return FUSB302_SUCCESS;
 }
 
+uint16_t PD_UFP_core_c::FUSB302_clock_ms(void)
+{
+    return (uint16_t)millis() * clock_prescaler;
+}
+
 void PD_UFP_core_c::handle_protocol_event(PD_protocol_event_t events)
 {    
     if (events & PD_PROTOCOL_EVENT_SRC_CAP) {
         wait_src_cap = 0;
+        wait_hard_reset = 0;
+        wait_vbus = STATUS_POWER_NA;
         get_src_cap_retry_count = 0;
         wait_ps_rdy = 1;
         time_wait_ps_rdy = clock_ms();
@@ -183,12 +551,38 @@ void PD_UFP_core_c::handle_protocol_event(PD_protocol_event_t events)
             status_log_event(STATUS_LOG_POWER_REJECT);
         }
     }    
+    if (events & PD_PROTOCOL_EVENT_EPR_MODE) {
+        time_EPR_keepalive = clock_ms();
+        status_log_event(STATUS_LOG_EPR_MODE);
+    }
+    if ((events & PD_PROTOCOL_EVENT_CABLE) && wait_cable) {
+        cable_discovered();
+    }
+    if (events & PD_PROTOCOL_EVENT_ALERT) {
+        uint8_t alert = PD_protocol_get_alert(&protocol);
+        // Shed load before anything else, then ask why. Battery status change is not reported in Status
+        status_alert(alert);
+        if (alert & ~PD_ALERT_BATTERY_STATUS) {
+            send_get_status = 1;
+        }
+        status_log_event(STATUS_LOG_ALERT);
+    }
+    if (events & PD_PROTOCOL_EVENT_STATUS) {
+        status_log_event(STATUS_LOG_STATUS);
+    }
     if (events & PD_PROTOCOL_EVENT_PS_RDY) {
         PD_power_info_t p;
         uint8_t i, selected_power = PD_protocol_get_selected_power(&protocol);
         PD_protocol_get_power_info(&protocol, selected_power, &p);
         wait_ps_rdy = 0;
-        if (p.type == PD_PDO_TYPE_AUGMENTED_PDO) {
+        // Explicit SPR contract is needed before EPR mode entry, source then sends EPR_Source_Capabilities
+        send_EPR_mode = PD_protocol_need_EPR_mode(&protocol);
+        send_cable_discovery = cable_discovery == 1;
+        if (p.type == PD_PDO_TYPE_EPR_AVS || p.type == PD_PDO_TYPE_SPR_AVS) {
+            // AVS mode, 9V minimum is above VBUSOK threshold and no keep alive request is needed
+            FUSB302_set_vbus_sense(&FUSB302, 1);
+            power_ready(STATUS_POWER_AVS, PD_protocol_get_PPS_voltage(&protocol), PD_protocol_get_PPS_current(&protocol));
+        } else if (p.type == PD_PDO_TYPE_AUGMENTED_PDO) {
             // PPS mode
             FUSB302_set_vbus_sense(&FUSB302, 0);
             if (PPS_voltage_next) {
@@ -199,14 +593,12 @@ void PD_UFP_core_c::handle_protocol_event(PD_protocol_event_t events)
                 status_log_event(STATUS_LOG_POWER_PPS_STARTUP);
             } else {
                 time_PPS_request = clock_ms();
-                status_power_ready(STATUS_POWER_PPS, 
-                    PD_protocol_get_PPS_voltage(&protocol), PD_protocol_get_PPS_current(&protocol));
-                status_log_event(STATUS_LOG_POWER_READY);
+                power_ready(STATUS_POWER_PPS, PD_protocol_get_PPS_voltage(&protocol), PD_protocol_get_PPS_current(&protocol));
             }
         } else {
+            uint16_t limit = PD_protocol_get_cable_limit(&protocol);
             FUSB302_set_vbus_sense(&FUSB302, 1);
-            status_power_ready(STATUS_POWER_TYP, p.max_v, p.max_i);
-            status_log_event(STATUS_LOG_POWER_READY);
+            power_ready(STATUS_POWER_TYP, p.max_v, limit && p.max_i > limit ? limit : p.max_i);
         }
     }
 }
@@ -214,11 +606,31 @@ void PD_UFP_core_c::handle_protocol_event(PD_protocol_event_t events)
 void PD_UFP_core_c::handle_FUSB302_event(FUSB302_event_t events)
 {
     if (events & FUSB302_EVENT_DETACHED) {
+        status_attached = 0;
+        wait_src_cap = 0;
+        wait_hard_reset = 0;
+        wait_ps_rdy = 0;
+        wait_sink_tx = 0;
+        send_EPR_mode = 0;
+        send_get_status = 0;
+        send_cable_discovery = 0;
+        wait_cable = 0;
+        tx_sop_prime = 0;
+        wait_vbus = STATUS_POWER_NA;
         PD_protocol_reset(&protocol);
+        if (cable_discovery) {
+            // Next cable is unknown, SOP' receive is disabled by FUSB302 detach
+            cable_discovery = 1;
+            PD_protocol_set_cable_current(&protocol, PD_A(3.0));
+        }
+        if (status_power != STATUS_POWER_NA) {
+            status_power_ready(STATUS_POWER_NA, 0, 0);
+        }
         return;
     }
     if (events & FUSB302_EVENT_ATTACHED) {
         uint8_t cc1 = 0, cc2 = 0, cc = 0;
+        status_attached = 1;
         FUSB302_get_cc(&FUSB302, &cc1, &cc2);
         PD_protocol_reset(&protocol);
         if (cc1 && cc2 == 0) {
@@ -234,12 +646,41 @@ void PD_UFP_core_c::handle_FUSB302_event(FUSB302_event_t events)
         }
         status_log_event(STATUS_LOG_CC);
     }
+    if (events & (FUSB302_EVENT_HARD_RESET_RECEIVED | FUSB302_EVENT_HARD_RESET_SENT)) {
+        // Source cycles VBUS, cut output now and wait for Source_Capabilities of the new contract
+        PD_protocol_reset(&protocol);
+        wait_ps_rdy = 0;
+        send_EPR_mode = 0;
+        send_get_status = 0;
+        send_cable_discovery = 0;
+        tx_sop_prime = 0;
+        if (wait_cable) {
+            wait_cable = 0;
+            FUSB302_set_sop_prime(&FUSB302, 0);
+        }
+        if (cable_discovery) {
+            cable_discovery = 1;    // Cable plug is reset too, discover again after the new contract
+        }
+        wait_vbus = STATUS_POWER_NA;
+        wait_src_cap = 1;
+        wait_hard_reset = 1;
+        get_src_cap_retry_count = 0;
+        time_wait_src_cap = time_hard_reset = clock_ms();
+        if (status_power != STATUS_POWER_NA) {
+            status_power_ready(STATUS_POWER_NA, 0, 0);
+        }
+        status_log_event(STATUS_LOG_HARD_RESET);
+    }
     if (events & FUSB302_EVENT_RX_SOP) {
         PD_protocol_event_t protocol_event = 0;
         uint16_t header;
         uint32_t obj[7];
         FUSB302_get_message(&FUSB302, &header, obj);
-        PD_protocol_handle_msg(&protocol, header, obj, &protocol_event);
+        if (FUSB302_get_rx_sop(&FUSB302) == FUSB302_SOP_PRIME) {
+            PD_protocol_handle_cable_msg(&protocol, header, obj, &protocol_event);
+        } else {
+            PD_protocol_handle_msg(&protocol, header, obj, &protocol_event);
+        }
         status_log_event(STATUS_LOG_MSG_RX, obj);
         if (protocol_event) {
             handle_protocol_event(protocol_event);
@@ -250,18 +691,50 @@ void PD_UFP_core_c::handle_FUSB302_event(FUSB302_event_t events)
         uint32_t obj[7];
         delay_ms(2);  /* Delay respond in case there are retry messages */
         if (PD_protocol_respond(&protocol, &header, obj)) {
+            // Result of a pending SOP' transmission is lost, cable discovery ends by timeout instead
+            tx_sop_prime = 0;
             status_log_event(STATUS_LOG_MSG_TX, obj);
             FUSB302_tx_sop(&FUSB302, header, obj);
         }
     }
+    if (events & FUSB302_EVENT_TX_SUCCESS) {
+        PPS_keepalive = 0;
+        tx_sop_prime = 0;
+    }
+    if (events & FUSB302_EVENT_TX_FAILED) {
+        uint8_t keepalive = PPS_keepalive;
+        PPS_keepalive = 0;
+        if (tx_sop_prime) {
+            // No GoodCRC on SOP', cable without e-marker
+            tx_sop_prime = 0;
+            if (wait_cable) {
+                cable_discovered();
+            }
+        } else if (wait_ps_rdy && keepalive) {
+            /* PPS keepalive not acknowledged, source is gone while VBUSOK is ignored. A failed renegotiation
+               is not proof of detach and falls back to default power below */
+            FUSB302_detach(&FUSB302);
+        } else if (wait_ps_rdy) {
+            /* Request not acknowledged after retries, fall back now instead of waiting for t_RequestToPSReady */
+            wait_ps_rdy = 0;
+            set_default_power();
+        }
+    }
 }
 
 bool PD_UFP_core_c::timer(void)
 {
     uint16_t t = clock_ms();
     if (wait_src_cap && t - time_wait_src_cap > t_TypeCSinkWaitCap) {
+        uint8_t vbus = 1;
         time_wait_src_cap = t;
-        if (get_src_cap_retry_count < 3) {
+        if (wait_hard_reset) {
+            FUSB302_get_vbus_level(&FUSB302, &vbus);
+            wait_hard_reset = (uint16_t)(t - time_hard_reset) < t_HardResetRecover;
+        }
+        if (vbus == 0 && wait_hard_reset) {
+            // VBUS not back after hard reset yet, Source_Capabilities follows it
+        } else if (get_src_cap_retry_count < 3) {
             uint16_t header;
             get_src_cap_retry_count += 1;
             /* Try to request soruce capabilities message (will not cause power cycle VBUS) */
@@ -275,13 +748,39 @@ bool PD_UFP_core_c::timer(void)
             PD_protocol_reset(&protocol);
         }
     }
+    if (wait_vbus) {
+        uint8_t reached = 0;
+        uint16_t mv = wait_vbus == STATUS_POWER_TYP ? wait_vbus_voltage * 50 : wait_vbus_voltage * 20;
+        FUSB302_check_vbus(&FUSB302, mv - mv / 16, &reached);   // Accept 94% of target
+        if (reached) {
+            status_power_ready(wait_vbus, wait_vbus_voltage, wait_vbus_current);
+            status_log_event(STATUS_LOG_POWER_READY);
+            wait_vbus = STATUS_POWER_NA;
+        } else if (t - time_wait_vbus > t_VBUSReady) {
+            // Contract stands but the rail is off target, report the measured VBUS instead of the contract
+            uint16_t vbus = 0;
+            FUSB302_measure_vbus(&FUSB302, &vbus);
+            status_log_event(STATUS_LOG_VBUS_TIMEOUT);
+            status_power_ready(wait_vbus, wait_vbus == STATUS_POWER_TYP ? vbus / 50 : vbus / 20, wait_vbus_current);
+            status_log_event(STATUS_LOG_POWER_READY);
+            wait_vbus = STATUS_POWER_NA;
+        }
+    }
+    if (wait_cable && t - time_wait_cable > t_VDMSenderResponse) {
+        cable_discovered();
+    }
+    // SinkTxOk is checked once per pass and only if a deferrable message is due
+    bool PPS_due = status_power == STATUS_POWER_PPS && t - time_PPS_request > t_PPSRequest;
+    bool tx_ok = !wait_ps_rdy && (send_request || PPS_due || send_get_status || send_cable_discovery || send_EPR_mode) &&
+        sink_tx_ok(t);
     if (wait_ps_rdy) {
         if (t - time_wait_ps_rdy > t_RequestToPSReady) {
             wait_ps_rdy = 0;
             set_default_power();
         }
-    } else if (send_request || (status_power == STATUS_POWER_PPS && t - time_PPS_request > t_PPSRequest)) {
+    } else if ((send_request || PPS_due) && tx_ok) {
         wait_ps_rdy = 1;
+        PPS_keepalive = !send_request && status_power == STATUS_POWER_PPS;
         send_request = 0;
         time_PPS_request = t;
         uint16_t header;
@@ -291,6 +790,40 @@ bool PD_UFP_core_c::timer(void)
         status_log_event(STATUS_LOG_MSG_TX, obj);
         time_wait_ps_rdy = clock_ms();
         FUSB302_tx_sop(&FUSB302, header, obj);
+    } else if (send_get_status && tx_ok) {
+        uint16_t header;
+        send_get_status = 0;
+        PD_protocol_create_get_status(&protocol, &header);
+        status_log_event(STATUS_LOG_MSG_TX);
+        FUSB302_tx_sop(&FUSB302, header, 0);
+    } else if (send_cable_discovery && tx_ok) {
+        uint16_t header;
+        uint32_t obj[7];
+        // Receive SOP' only while waiting for the e-marker, GoodCRC is sent for every enabled SOP*
+        send_cable_discovery = 0;
+        wait_cable = 1;
+        tx_sop_prime = 1;
+        time_wait_cable = t;
+        PD_protocol_create_cable_discover_identity(&protocol, &header, obj);
+        status_log_event(STATUS_LOG_MSG_TX, obj);
+        FUSB302_set_sop_prime(&FUSB302, 1);
+        FUSB302_tx_sop_prime(&FUSB302, header, obj);
+    } else if (send_EPR_mode && tx_ok) {
+        uint16_t header;
+        uint32_t obj[7];
+        send_EPR_mode = 0;
+        PD_protocol_create_EPR_mode(&protocol, &header, obj);
+        status_log_event(STATUS_LOG_MSG_TX, obj);
+        FUSB302_tx_sop(&FUSB302, header, obj);
+    } else if (PD_protocol_is_EPR_mode(&protocol) && t - time_EPR_keepalive > t_EPRKeepAlive && !tx_sop_prime) {
+        uint16_t header;
+        uint32_t obj[7];
+        /* Source exits EPR mode with Hard Reset if EPR_KeepAlive is missing, not deferred by SinkTxNG as
+           t_SinkTxDefer on top of t_EPRKeepAlive would exceed the source timeout */
+        time_EPR_keepalive = t;
+        PD_protocol_create_EPR_keepalive(&protocol, &header, obj);
+        status_log_event(STATUS_LOG_MSG_TX, obj);
+        FUSB302_tx_sop(&FUSB302, header, obj);
     }
     if (t - time_polling > t_PD_POLLING) {
         time_polling = t;
@@ -299,6 +832,60 @@ bool PD_UFP_core_c::timer(void)
     return false;
 }
 
+bool PD_UFP_core_c::sink_tx_ok(uint16_t t)
+{
+    // PD3.0 collision avoidance, defer sink initiated request while source presents SinkTxNG
+    uint8_t ok = 1;
+    if (tx_sop_prime) {
+        return false;   // Hold SOP until the SOP' result is in, so a failure is not blamed on the wrong message
+    }
+    if (status_power == STATUS_POWER_NA || PD_protocol_get_spec_rev(&protocol) < 2) {
+        return true;
+    }
+    if (!wait_sink_tx) {
+        wait_sink_tx = 1;
+        time_sink_tx = t;
+    } else if ((uint16_t)(t - time_sink_tx) > t_SinkTxDefer) {
+        wait_sink_tx = 0;
+        return true;
+    }
+    if (FUSB302_get_sink_tx_ok(&FUSB302, &ok) == FUSB302_SUCCESS && ok) {
+        wait_sink_tx = 0;
+        return true;
+    }
+    return false;
+}
+
+bool PD_UFP_core_c::timer_armed(void)
+{
+    // Attach detection is polled unless FUSB302 toggles, PPS mode needs periodic request to keep power alive,
+    // EPR mode needs EPR_KeepAlive
+    return (!status_attached && !FUSB302.toggle) || wait_src_cap || wait_ps_rdy || wait_vbus || send_request ||
+        send_EPR_mode || send_get_status || send_cable_discovery || wait_cable || status_power == STATUS_POWER_PPS ||
+        PD_protocol_is_EPR_mode(&protocol);
+}
+
+void PD_UFP_core_c::power_ready(status_power_t status, uint16_t voltage, uint16_t current)
+{
+    if (vbus_check) {
+        // Hold ready status until VBUS is measured at the new voltage, see timer()
+        wait_vbus = status;
+        wait_vbus_voltage = voltage;
+        wait_vbus_current = current;
+        time_wait_vbus = clock_ms();
+        return;
+    }
+    status_power_ready(status, voltage, current);
+    status_log_event(STATUS_LOG_POWER_READY);
+}
+
+uint16_t PD_UFP_core_c::get_vbus(void)
+{
+    uint16_t vbus = 0;
+    FUSB302_measure_vbus(&FUSB302, &vbus);
+    return vbus;
+}
+
 void PD_UFP_core_c::set_default_power(void)
 {
     status_power_ready(STATUS_POWER_TYP, PD_V(5), PD_A(1));
@@ -307,12 +894,18 @@ void PD_UFP_core_c::set_default_power(void)
 
 void PD_UFP_core_c::status_power_ready(status_power_t status, uint16_t voltage, uint16_t current)
 {
+    PD_UFP_snapshot_t * snapshot = &PD_UFP_snapshot[FUSB302.i2c_address & 3];
     ready_voltage = voltage;
     ready_current = current;
     status_power = status;
+    snapshot->status = status;
+    snapshot->voltage = voltage;
+    snapshot->current = current;
+    snapshot->check = PD_UFP_snapshot_check(snapshot);
 }
 
 uint8_t PD_UFP_core_c::clock_prescaler = 1;
+PD_UFP_I2C_clock_t PD_UFP_core_c::i2c_clock = PD_UFP_I2C_CLOCK_100KHZ;
 
 void PD_UFP_core_c::delay_ms(uint16_t ms)
 {
@@ -387,13 +980,25 @@ void PD_UFP_c::run(void)
 void PD_UFP_c::status_power_ready(status_power_t status, uint16_t voltage, uint16_t current)
 {
     PD_UFP_core_c::status_power_ready(status, voltage, current);
-    if (status == STATUS_POWER_PPS) {
+    if (status == STATUS_POWER_NA) {
+        set_output(0);  // Detached, load switch off at once
+        led_voltage = PD_UFP_VOLTAGE_LED_OFF;
+        led_current = PD_UFP_CURRENT_LED_OFF;
+    } else if (status == STATUS_POWER_PPS || status == STATUS_POWER_AVS) {
         calculate_led_pps(voltage, current);
     } else {
         calculate_led(voltage, current);
     }
 }
 
+void PD_UFP_c::status_alert(uint8_t alert)
+{
+    if (alert & PD_ALERT_FAULT) {
+        set_output(0);  // Source protection tripped, load switch off before the source cuts VBUS
+    }
+    PD_UFP_core_c::status_alert(alert);
+}
+
 void PD_UFP_c::calculate_led(uint16_t voltage, uint16_t current)
 {
     uint8_t i;
@@ -533,7 +1138,8 @@ void PD_UFP_log_c::status_log_event(uint8_t status, uint32_t * obj)
         log->obj_count = status_log_obj_add(log->msg_header, obj);
         break;
     case STATUS_LOG_MSG_RX:
-        log->msg_header = PD_protocol_get_rx_msg_header(&protocol);
+        log->msg_header = FUSB302_get_rx_sop(&FUSB302) == FUSB302_SOP_PRIME ?
+            PD_protocol_get_cable_msg_header(&protocol) : PD_protocol_get_rx_msg_header(&protocol);
         log->obj_count = status_log_obj_add(log->msg_header, obj);
         break;
     default:
@@ -548,9 +1154,11 @@ void PD_UFP_log_c::status_log_event(uint8_t status, uint32_t * obj)
 #if defined(__AVR__)
 #include <avr/pgmspace.h>
 #define SNPRINTF snprintf_P
+#define PGM_S "%S"     // string argument in program memory
 #else
 #define SNPRINTF snprintf
 #define PSTR(str) str
+#define PGM_S "%s"
 #endif
 
 #define LOG(format, ...) do { n = SNPRINTF(buffer, maxlen, PSTR(format), ## __VA_ARGS__); } while (0)
@@ -566,12 +1174,12 @@ int PD_UFP_log_c::status_log_readline_msg(char * buffer, int maxlen, status_log_
         PD_protocol_get_msg_info(log->msg_header, &info);
         if (status_log_level >= PD_LOG_LEVEL_VERBOSE) {
             const char * ext = info.extended ? "ext, " : "";
-            LOG("%s%cX %s id=%d %sraw=0x%04X\n", t, type, info.name, info.id, ext, log->msg_header);
+            LOG("%s%cX " PGM_S " id=%d %sraw=0x%04X\n", t, type, info.name, info.id, ext, log->msg_header);
             if (info.num_of_obj) {
                 status_log_counter++;
             }
         } else {
-            LOG("%s%cX %s\n", t, type, info.name);
+            LOG("%s%cX " PGM_S "\n", t, type, info.name);
         }
     } else {
         // output object data
@@ -590,8 +1198,10 @@ int PD_UFP_log_c::status_log_readline_src_cap(char * buffer, int maxlen)
     PD_power_info_t p;
     int n = 0;
     uint8_t i = status_log_counter;
-    if (PD_protocol_get_power_info(&protocol, i, &p)) {
-        const char * str_pps[] = {"", " BAT", " VAR", " PPS"};  /* PD_power_data_obj_type_t */
+    if (PD_protocol_get_power_info(&protocol, i, &p) && p.max_v == 0) {
+        status_log_counter++;   // unused SPR slot of EPR_Source_Capabilities
+    } else if (PD_protocol_get_power_info(&protocol, i, &p)) {
+        const char * str_pps[] = {"", " BAT", " VAR", " PPS", " AVS", " AVS"};  /* PD_power_data_obj_type_t */
         char * t = status_log_time;
         uint8_t selected = PD_protocol_get_selected_power(&protocol);
         char min_v[8] = {0}, max_v[8] = {0}, power[8] = {0};
@@ -662,8 +1272,13 @@ int PD_UFP_log_c::status_log_readline(char * buffer, int maxlen)
             LOG("%s%d.%02dV %d.%02dA supply ready\n", t, v / 20, (v * 5) % 100, a / 100, a % 100);
         } else if (status_power == STATUS_POWER_PPS) {
             LOG("%sPPS %d.%02dV %d.%02dA supply ready\n", t, v / 50, (v * 2) % 100, a / 20, (a * 5) % 100);
+        } else if (status_power == STATUS_POWER_AVS) {
+            LOG("%sAVS %d.%02dV %d.%02dA supply ready\n", t, v / 50, (v * 2) % 100, a / 20, (a * 5) % 100);
         }
         break; }
+    case STATUS_LOG_VBUS_TIMEOUT:
+        LOG("%sVBUS below 94%% of contract\n", t);
+        break;
     case STATUS_LOG_POWER_PPS_STARTUP:
         LOG("%sPPS 2-stage startup\n", t);
         break;
@@ -676,6 +1291,38 @@ int PD_UFP_log_c::status_log_readline(char * buffer, int maxlen)
     case STATUS_LOG_LOAD_SW_OFF:
         LOG("%sLoad SW OFF\n", t);
         break;
+    case STATUS_LOG_HARD_RESET:
+        LOG("%sHard Reset\n", t);
+        break;
+    case STATUS_LOG_EPR_MODE:
+        if (protocol.EPR_state == PD_EPR_STATE_ON) {
+            LOG("%sEPR mode entered\n", t);
+        } else if (protocol.EPR_state == PD_EPR_STATE_FAILED) {
+            LOG("%sEPR mode entry failed\n", t);
+        } else {
+            LOG("%sEPR mode exited\n", t);
+        }
+        break;
+    case STATUS_LOG_ALERT: {
+        const char * str_alert[] = {"", " BAT", " OCP", " OTP", " OPC", " SRC", " OVP", " EXT"};   /* PD_ALERT_* bits */
+        uint8_t alert = PD_protocol_get_alert(&protocol);
+        char type[32] = {0};
+        for (uint8_t i = 1; i < 8; i++) {
+            if (alert & (1 << i)) {
+                strcat(type, str_alert[i]);
+            }
+        }
+        LOG("%sAlert%s\n", t, type);
+        break; }
+    case STATUS_LOG_STATUS: {
+        PD_status_t s;
+        PD_protocol_get_status(&protocol, &s);
+        LOG("%sStatus temp %dC flags %02X power %02X\n", t, s.internal_temp, s.event_flags, s.power_status);
+        break; }
+    case STATUS_LOG_CABLE: {
+        uint16_t a = PD_protocol_get_cable_limit(&protocol);
+        LOG("%sCable %d.%02dA%s\n", t, a / 100, a % 100, PD_protocol_get_cable_vdo(&protocol) ? " e-marker" : "");
+        break; }
     }
     if (status_log_counter == 0) {
         t[0] = 0;
@@ -10,6 +10,8 @@
  * Requires FUSB302_UFP.h, PD_UFP_Protocol.h and Standard Arduino Library
  *
  * Support PD3.0 PPS
+ * Support PD3.1 EPR, fixed and AVS power above 20V
+ * Support PD3.2 SPR AVS
  * 
  */
 
@@ -19,14 +21,18 @@
 #include <stdint.h>
 
 #include <Arduino.h>
-#include <Wire.h>
 #include <HardwareSerial.h>
 
 extern "C" {
     #include "FUSB302_UFP.h"
     #include "PD_UFP_Protocol.h"
+    #include "PD_UFP_TWI.h"
 }
 
+#if !PD_UFP_TWI_ENABLE
+#include <Wire.h>
+#endif
+
 enum {
     PD_UFP_VOLTAGE_LED_OFF      = 0,
     PD_UFP_VOLTAGE_LED_5V       = 1,
@@ -50,10 +56,18 @@ typedef uint8_t PD_UFP_CURRENT_LED_t;
 enum {
     STATUS_POWER_NA = 0,
     STATUS_POWER_TYP,
-    STATUS_POWER_PPS
+    STATUS_POWER_PPS,
+    STATUS_POWER_AVS
 };
 typedef uint8_t status_power_t;
 
+enum {
+    PD_UFP_I2C_CLOCK_100KHZ = 0,
+    PD_UFP_I2C_CLOCK_400KHZ,
+    PD_UFP_I2C_CLOCK_1MHZ       // FUSB302 supports Fast-mode Plus
+};
+typedef uint8_t PD_UFP_I2C_clock_t;
+
 ///////////////////////////////////////////////////////////////////////////////////////////////////
 // PD_UFP_core_c
 ///////////////////////////////////////////////////////////////////////////////////////////////////
@@ -64,32 +78,87 @@ class PD_UFP_core_c
         // Init
         void init(enum PD_power_option_t power_option = PD_POWER_OPTION_MAX_5V);
         void init_PPS(uint16_t PPS_voltage, uint8_t PPS_current, enum PD_power_option_t power_option = PD_POWER_OPTION_MAX_5V);
+        void init_AVS(uint16_t AVS_voltage, uint8_t AVS_current, enum PD_power_option_t power_option = PD_POWER_OPTION_MAX_5V);
+        // Port, set before init. Default: address 0x22 and INT pin 7 of PD Micro
+        void set_port(uint8_t i2c_address, uint8_t pin_int);
+#if !PD_UFP_TWI_ENABLE
+        void set_port(TwoWire & wire, uint8_t i2c_address, uint8_t pin_int);
+#endif
         // Task
-        void run(void);
+        virtual void run(void);
+        static void run_all(void);  // Round-robin service of all initialized ports
         // Status
         bool is_power_ready(void) { return status_power == STATUS_POWER_TYP; }
         bool is_PPS_ready(void)   { return status_power == STATUS_POWER_PPS; }
-        bool is_ps_transition(void) { return send_request || wait_ps_rdy; }
+        bool is_AVS_ready(void)   { return status_power == STATUS_POWER_AVS; }
+        bool is_EPR_mode(void)    { return PD_protocol_is_EPR_mode(&protocol); }
+        bool is_ps_transition(void) { return send_request || wait_ps_rdy || wait_vbus; }
         // Get
-        uint16_t get_voltage(void) { return ready_voltage; }    // Voltage in 50mV units, 20mV(PPS)
-        uint16_t get_current(void) { return ready_current; }    // Current in 10mA units, 50mA(PPS)
+        uint16_t get_voltage(void) { return ready_voltage; }    // Voltage in 50mV units, 20mV(PPS, AVS)
+        uint16_t get_current(void) { return ready_current; }    // Current in 10mA units, 50mA(PPS, AVS)
+        uint16_t get_vbus(void);                                // Measured VBUS in mV, 420mV resolution
         // Set
         bool set_PPS(uint16_t PPS_voltage, uint8_t PPS_current);
+        bool set_AVS(uint16_t AVS_voltage, uint8_t AVS_current);
         void set_power_option(enum PD_power_option_t power_option);
+        // Voltage window, minimum current, power floor and tie-break, set after init
+        void set_power_policy(const PD_power_policy_t & policy);
+        // Sink_Capabilities sent on Get_Sink_Cap, up to 7 PDOs packed by PD_protocol_sink_*(), set after init
+        bool set_sink_cap(const uint32_t * pdo, uint8_t count) { return PD_protocol_set_sink_cap(&protocol, pdo, count); }
+        // Sink_Capabilities_Extended with PDP, kept by caller and read on Get_Sink_Cap_Extended, set after init
+        void set_sink_cap_ext(const PD_sink_cap_ext_t * ext) { PD_protocol_set_sink_cap_ext(&protocol, ext); }
+        // Discover Identity, SVIDs and Modes answers and custom SVID callback, kept by caller, set after init
+        void set_VDM_table(const PD_VDM_table_t * table) { PD_protocol_set_VDM_table(&protocol, table); }
+        // Discover cable e-marker on SOP' after the first contract, current is capped at 3A until the cable
+        // reports 5A. Set after init
+        void cable_discovery_set(bool enable);
+        uint16_t get_cable_current(void) { return PD_protocol_get_cable_limit(&protocol); }  // 10mA units, 0 if not limited
+        // Alert from source, PD_ALERT_* bits of the last Alert. Status is fetched after each Alert to tell why
+        uint8_t get_alert(void) { return PD_protocol_get_alert(&protocol); }
+        bool get_status(PD_status_t * status) { return PD_protocol_get_status(&protocol, status); }
+        // Power ready only after VBUS is measured at the new voltage
+        void vbus_check_set(bool enable) { vbus_check = enable; }
+        // I2C fault counters, wrap around
+        uint8_t get_i2c_error_count(void) { return FUSB302_get_i2c_err_count(&FUSB302); }
+        uint8_t get_i2c_recover_count(void) { return i2c_recover_count; }
         // Clock
         static void clock_prescale_set(uint8_t prescaler);
+        static void i2c_clock_set(PD_UFP_I2C_clock_t clock);
+        // Wakeup on FUSB302 INT pin interrupt, run() returns at once when nothing is pending
+        void int_wakeup_set(bool enable);
+        // Attach detected by FUSB302 hardware toggle, no I2C traffic while unattached. Set before init
+        void attach_toggle_set(bool enable) { FUSB302.toggle = enable; }
+        // Keep the contract across MCU reset if FUSB302 is still attached, no VBUS power cycle. Set before init
+        void warm_start_set(bool enable) { warm_start = enable; }
 
     protected:
-        static FUSB302_ret_t FUSB302_i2c_read(uint8_t dev_addr, uint8_t reg_addr, uint8_t *data, uint8_t count);
-        static FUSB302_ret_t FUSB302_i2c_write(uint8_t dev_addr, uint8_t reg_addr, uint8_t *data, uint8_t count);
-        static FUSB302_ret_t FUSB302_delay_ms(uint32_t t);
+        static FUSB302_ret_t FUSB302_i2c_read(void *context, uint8_t dev_addr, uint8_t reg_addr, uint8_t *data, uint8_t count);
+        static FUSB302_ret_t FUSB302_i2c_write(void *context, uint8_t dev_addr, uint8_t reg_addr, uint8_t *data, uint8_t count);
+        static FUSB302_ret_t FUSB302_delay_ms(void *context, uint32_t t);
+        static uint16_t FUSB302_clock_ms(void);
+#if PD_UFP_TWI_ENABLE
+        static FUSB302_ret_t FUSB302_i2c_read_burst(void *context, uint8_t dev_addr, uint8_t reg_addr, uint8_t *data, uint8_t count,
+            FUSB302_burst_len_t burst_len);
+#endif
         void handle_protocol_event(PD_protocol_event_t events);
         void handle_FUSB302_event(FUSB302_event_t events);
         bool timer(void);
+        bool timer_armed(void);
+        bool sink_tx_ok(uint16_t t);
         void set_default_power(void);
+        void resume(void);
+        void power_ready(status_power_t status, uint16_t voltage, uint16_t current);
+        void cable_discovered(void);
         // Device
         FUSB302_dev_t FUSB302;
         PD_protocol_t protocol;
+        // Port
+        uint8_t pin_int;
+#if !PD_UFP_TWI_ENABLE
+        TwoWire * wire;
+#endif
+        PD_UFP_core_c * port_next;
+        static PD_UFP_core_c * port_list;
         // Power ready power
         uint16_t ready_voltage;
         uint16_t ready_current;
@@ -98,6 +167,7 @@ class PD_UFP_core_c
         uint8_t PPS_current_next;
         // Status
         virtual void status_power_ready(status_power_t status, uint16_t voltage, uint16_t current);
+        virtual void status_alert(uint8_t alert);   // Load shedding, called as soon as Alert is received
         uint8_t status_initialized;
         uint8_t status_src_cap_received;
         status_power_t status_power;
@@ -106,11 +176,44 @@ class PD_UFP_core_c
         uint16_t time_wait_src_cap;
         uint16_t time_wait_ps_rdy;
         uint16_t time_PPS_request;
+        uint16_t time_wait_vbus;
+        uint16_t time_hard_reset;
+        uint16_t time_sink_tx;
+        uint16_t time_EPR_keepalive;
+        uint16_t time_wait_cable;
         uint8_t get_src_cap_retry_count;
         uint8_t wait_src_cap;
+        uint8_t wait_hard_reset;
+        uint8_t wait_sink_tx;
         uint8_t wait_ps_rdy;
         uint8_t send_request;
+        uint8_t PPS_keepalive;          // Outstanding Request is the periodic PPS keep alive
+        uint8_t send_EPR_mode;
+        uint8_t send_get_status;
+        uint8_t cable_discovery;        // 0: off, 1: not discovered yet, 2: discovered
+        uint8_t send_cable_discovery;
+        uint8_t wait_cable;
+        uint8_t tx_sop_prime;           // Outstanding transmission is Discover Identity on SOP'
+        uint8_t vbus_check;
+        status_power_t wait_vbus;
+        uint16_t wait_vbus_voltage;
+        uint16_t wait_vbus_current;
+        uint8_t FUSB302_busy;
+        // I2C fault recovery
+        uint8_t i2c_fail_count;
+        uint16_t time_i2c_fail;
+        uint8_t i2c_recover_count;
+        void i2c_recover(void);
+        uint8_t status_attached;
+        // Interrupt wakeup
+        uint8_t int_wakeup;
+        volatile uint8_t int_pending;
+        static void FUSB302_int_isr(void);
+        // Warm start
+        uint8_t warm_start;
         static uint8_t clock_prescaler;
+        static PD_UFP_I2C_clock_t i2c_clock;
+        static void i2c_setup(void);
         // Time functions        
         void delay_ms(uint16_t ms);
         uint16_t clock_ms(void);
@@ -132,11 +235,13 @@ class PD_UFP_c : public PD_UFP_core_c
         // Set Load Switch
         void set_output(uint8_t enable);
         // Task
-        void run(void);
+        virtual void run(void);
 
     protected:
         // Status
         virtual void status_power_ready(status_power_t status, uint16_t voltage, uint16_t current);
+        // Load switch off on OCP, OTP or OVP Alert, it stays off until the application calls set_output(1)
+        virtual void status_alert(uint8_t alert);
         // LED
         uint8_t led_blink_enable;
         uint8_t led_blink_status;
@@ -11,10 +11,16 @@
  * No use of bit-field for better cross-platform compatibility
  *
  * Support PD3.0 PPS
- * Do not support extended message. Not necessary for PD trigger and PPS.
+ * Support PD3.1 EPR fixed and AVS power up to 48V
+ * Support PD3.2 SPR AVS
+ * Support chunked extended message up to 260 bytes, one reassembly buffer is shared by all ports
+ * Support structured VDM Discover Identity, SVIDs and Modes responses from PD_VDM_table_t
+ * Support SOP' Discover Identity of cable e-marker, cable current limits PDO selection
+ * Support Alert and Status
  * 
  * Reference: USB_PD_R2_0 V1.3 - 20170112
  *            USB_PD_R3_0 V2.0 20190829 + ECNs 2020-12-10
+ *            USB_PD_R3_1 V1.0 20210501
  *            - Chapter 6. Protocol Layer
  *
  */
@@ -24,17 +30,48 @@
 
 #define PD_SPECIFICATION_REVISION           0x2
 
+#define PD_CONTROL_MSG_TYPE_GOOD_CRC        0x1
 #define PD_CONTROL_MSG_TYPE_ACCEPT          0x3
 #define PD_CONTROL_MSG_TYPE_REJECT          0x4
 #define PD_CONTROL_MSG_TYPE_GET_SRC_CAP     0x7
 #define PD_CONTROL_MSG_TYPE_NOT_SUPPORT     0x10
+#define PD_CONTROL_MSG_TYPE_GET_STATUS      0x12
 #define PD_CONTROL_MSG_TYPE_GET_PPS_STATUS  0x14
 
 #define PD_DATA_MSG_TYPE_REQUEST            0x2
 #define PD_DATA_MSG_TYPE_SINK_CAP           0x4
+#define PD_DATA_MSG_TYPE_EPR_REQUEST        0x9
+#define PD_DATA_MSG_TYPE_EPR_MODE           0xA
 #define PD_DATA_MSG_TYPE_VENDOR_DEFINED     0xF
 
 #define PD_EXT_MSG_TYPE_SINK_CAP_EXT        0xF
+#define PD_EXT_MSG_TYPE_EXT_CONTROL         0x10
+
+/* Reference: 6.4.10 EPR_Mode Message, Action field */
+#define PD_EPR_MODE_ENTER                   1
+#define PD_EPR_MODE_ENTER_ACK               2
+#define PD_EPR_MODE_ENTER_SUCCEEDED         3
+#define PD_EPR_MODE_ENTER_FAILED            4
+#define PD_EPR_MODE_EXIT                    5
+#define PD_EPR_SINK_PDP                     140     /* EPR Sink Operational PDP in Watt */
+
+/* Reference: 6.5.14 Extended_Control Message, Type field */
+#define PD_EXT_CONTROL_EPR_KEEPALIVE        3
+#define PD_EXT_CONTROL_EPR_KEEPALIVE_ACK    4
+
+/* Reference: 6.4.4.2 Structured VDM, Command field */
+#define PD_VDM_CMD_DISCOVER_IDENTITY        1
+#define PD_VDM_CMD_DISCOVER_SVIDS           2
+#define PD_VDM_CMD_DISCOVER_MODES           3
+#define PD_VDM_CMD_ATTENTION                6
+#define PD_VDM_MAX_SVID                     11      /* 6 VDOs with the 0x0000 terminator */
+
+/* Reference: 6.2.1.2 Extended Message Header */
+#define PD_EXT_HEADER_CHUNKED               ((uint16_t)1 << 15)
+#define PD_EXT_HEADER_REQUEST_CHUNK         ((uint16_t)1 << 10)
+#define PD_EXT_HEADER_DATA_SIZE_MASK        0x1FF
+#define PD_EXT_CHUNK_SIZE                   26      /* MaxExtendedMsgChunkLen */
+#define PD_SINK_CAP_EXT_SIZE                24      /* SKEDB with EPR PDP, USB PD 3.1 */
 
 typedef struct {
     uint8_t type;
@@ -43,33 +80,29 @@ typedef struct {
     uint8_t num_of_obj;
 } PD_msg_header_info_t;
 
-typedef struct {
-    uint16_t limit;
-    uint8_t use_voltage;
-    uint8_t use_current;
-} PD_power_option_setting_t;
+typedef void (*PD_msg_handler_t)(PD_protocol_t * p, uint16_t header, uint32_t * obj, PD_protocol_event_t * events);
+typedef bool (*PD_msg_responder_t)(PD_protocol_t * p, uint16_t * header, uint32_t * obj);
 
 struct PD_msg_state_t {
     const char * name;
-    void (*handler)(PD_protocol_t * p, uint16_t header, uint32_t * obj, PD_protocol_event_t * events);
-    bool (*responder)(PD_protocol_t * p, uint16_t * header, uint32_t * obj);
+    PD_msg_handler_t handler;
+    PD_msg_responder_t responder;
 };
 
-/* Optimize RAM usage on AVR MCU by allocate const in PROGMEM */
+/* Optimize RAM usage on AVR MCU by allocate const in PROGMEM.
+   Message tables are read in place, only the used pointer is fetched from flash */
 #if defined(__AVR__)
 #include <avr/pgmspace.h>
-#define SET_MSG_STAGE(d, s) do { static struct PD_msg_state_t m; memcpy_P(&m, s, sizeof(struct PD_msg_state_t)); d = &m; } while (0)
-#define SET_MSG_NAME(d, s)  do { static char n[16]; strncpy_P(n, s, 15); d = n; } while (0)
-#define COPY_PDO(d, s)      do { memcpy_P(&d, &s, 4); } while (0)
+#define READ_PTR(s)             pgm_read_ptr(&(s))
+#define COPY_PDO(d, s)          do { memcpy_P(&d, &s, 4); } while (0)
+#define COPY_STRUCT(d, s)       do { memcpy_P(&d, &s, sizeof(d)); } while (0)
 #else
 #define PROGMEM
-#define SET_MSG_STAGE(d, s) do { d = s; } while (0)
-#define SET_MSG_NAME(d, s)  do { d = s; } while (0)
-#define COPY_PDO(d, s)      do { d = s; } while (0)
+#define READ_PTR(s)             (s)
+#define COPY_PDO(d, s)          do { d = s; } while (0)
+#define COPY_STRUCT(d, s)       do { d = s; } while (0)
 #endif
 
-#define T(name) static const char str_ ## name [] PROGMEM = #name
-
 static void handler_good_crc   (PD_protocol_t * p, uint16_t header, uint32_t * obj, PD_protocol_event_t * events);
 static void handler_goto_min   (PD_protocol_t * p, uint16_t header, uint32_t * obj, PD_protocol_event_t * events);
 static void handler_accept     (PD_protocol_t * p, uint16_t header, uint32_t * obj, PD_protocol_event_t * events);
@@ -79,7 +112,11 @@ static void handler_source_cap (PD_protocol_t * p, uint16_t header, uint32_t * o
 static void handler_BIST       (PD_protocol_t * p, uint16_t header, uint32_t * obj, PD_protocol_event_t * events);
 static void handler_alert      (PD_protocol_t * p, uint16_t header, uint32_t * obj, PD_protocol_event_t * events);
 static void handler_vender_def (PD_protocol_t * p, uint16_t header, uint32_t * obj, PD_protocol_event_t * events);
+static void handler_ext_msg    (PD_protocol_t * p, uint16_t header, uint32_t * obj, PD_protocol_event_t * events);
+static void handler_status     (PD_protocol_t * p, uint16_t header, uint32_t * obj, PD_protocol_event_t * events);
 static void handler_PPS_Status (PD_protocol_t * p, uint16_t header, uint32_t * obj, PD_protocol_event_t * events);
+static void handler_EPR_mode   (PD_protocol_t * p, uint16_t header, uint32_t * obj, PD_protocol_event_t * events);
+static void handler_EPR_src_cap(PD_protocol_t * p, uint16_t header, uint32_t * obj, PD_protocol_event_t * events);
 
 static bool responder_get_sink_cap  (PD_protocol_t * p, uint16_t * header, uint32_t * obj);
 static bool responder_reject        (PD_protocol_t * p, uint16_t * header, uint32_t * obj);
@@ -88,132 +125,204 @@ static bool responder_source_cap    (PD_protocol_t * p, uint16_t * header, uint3
 static bool responder_vender_def    (PD_protocol_t * p, uint16_t * header, uint32_t * obj);
 static bool responder_sink_cap_ext  (PD_protocol_t * p, uint16_t * header, uint32_t * obj);
 static bool responder_not_support   (PD_protocol_t * p, uint16_t * header, uint32_t * obj);
+static bool responder_chunk_request (PD_protocol_t * p, uint16_t * header, uint32_t * obj);
+static bool responder_chunk         (PD_protocol_t * p, uint16_t * header, uint32_t * obj);
+static bool responder_EPR_src_cap   (PD_protocol_t * p, uint16_t * header, uint32_t * obj);
+static bool responder_ext_control   (PD_protocol_t * p, uint16_t * header, uint32_t * obj);
 
-T(C0); T(GoodCRC); T(GotoMin); T(Accept); T(Reject); T(Ping); T(PS_RDY); T(Get_Src_Cap);
-T(Get_Sink_Cap); T(DR_Swap); T(PR_Swap); T(VCONN_Swap); T(Wait); T(Soft_Rst); T(Dat_Rst); T(Dat_Rst_Cpt);
-T(NS); T(Get_Src_Ext); T(Get_Stat); T(FR_Swap); T(Get_PPS_Stat); T(Get_CC); T(Get_Sink_Ext); T(C_R);
-
-static const struct PD_msg_state_t ctrl_msg_list[] PROGMEM = {
-    {.name = str_C0,            .handler = 0,                   .responder = 0},
-    {.name = str_GoodCRC,       .handler = handler_good_crc,    .responder = 0},
-    {.name = str_GotoMin,       .handler = handler_goto_min,    .responder = 0},
-    {.name = str_Accept,        .handler = handler_accept,      .responder = 0},
-    {.name = str_Reject,        .handler = handler_reject,      .responder = 0},
-    {.name = str_Ping,          .handler = 0,                   .responder = 0},
-    {.name = str_PS_RDY,        .handler = handler_ps_rdy,      .responder = 0},
-    {.name = str_Get_Src_Cap,   .handler = 0,                   .responder = responder_not_support},
-    {.name = str_Get_Sink_Cap,  .handler = 0,                   .responder = responder_get_sink_cap},
-    {.name = str_DR_Swap,       .handler = 0,                   .responder = responder_reject},
-    {.name = str_PR_Swap,       .handler = 0,                   .responder = responder_not_support},
-    {.name = str_VCONN_Swap,    .handler = 0,                   .responder = responder_reject},
-    {.name = str_Wait,          .handler = 0,                   .responder = 0},
-    {.name = str_Soft_Rst,      .handler = 0,                   .responder = responder_soft_reset},
-    {.name = str_Dat_Rst,       .handler = 0,                   .responder = 0},
-    {.name = str_Dat_Rst_Cpt,   .handler = 0,                   .responder = 0},
-    
-    {.name = str_NS,            .handler = 0,                   .responder = 0},
-    {.name = str_Get_Src_Ext,   .handler = 0,                   .responder = responder_not_support},
-    {.name = str_Get_Stat,      .handler = 0,                   .responder = responder_not_support},
-    {.name = str_FR_Swap,       .handler = 0,                   .responder = responder_not_support},
-    {.name = str_Get_PPS_Stat,  .handler = 0,                   .responder = responder_not_support},
-    {.name = str_Get_CC,        .handler = 0,                   .responder = responder_not_support},
-    {.name = str_Get_Sink_Ext,  .handler = 0,                   .responder = responder_sink_cap_ext},
-    {.name = str_C_R,           .handler = 0,                   .responder = responder_not_support},
-};
+/* Message lists, X(name, handler, responder) in order of message type. The last entry is used for
+   reserved types. Name strings and PROGMEM tables are generated from the same list */
+#define CTRL_MSG_LIST(X) \
+    X(C0,             0,                  0                       ) \
+    X(GoodCRC,        handler_good_crc,   0                       ) \
+    X(GotoMin,        handler_goto_min,   0                       ) \
+    X(Accept,         handler_accept,     0                       ) \
+    X(Reject,         handler_reject,     0                       ) \
+    X(Ping,           0,                  0                       ) \
+    X(PS_RDY,         handler_ps_rdy,     0                       ) \
+    X(Get_Src_Cap,    0,                  responder_not_support   ) \
+    X(Get_Sink_Cap,   0,                  responder_get_sink_cap  ) \
+    X(DR_Swap,        0,                  responder_reject        ) \
+    X(PR_Swap,        0,                  responder_not_support   ) \
+    X(VCONN_Swap,     0,                  responder_reject        ) \
+    X(Wait,           0,                  0                       ) \
+    X(Soft_Rst,       0,                  responder_soft_reset    ) \
+    X(Dat_Rst,        0,                  0                       ) \
+    X(Dat_Rst_Cpt,    0,                  0                       ) \
+    X(NS,             0,                  0                       ) \
+    X(Get_Src_Ext,    0,                  responder_not_support   ) \
+    X(Get_Stat,       0,                  responder_not_support   ) \
+    X(FR_Swap,        0,                  responder_not_support   ) \
+    X(Get_PPS_Stat,   0,                  responder_not_support   ) \
+    X(Get_CC,         0,                  responder_not_support   ) \
+    X(Get_Sink_Ext,   0,                  responder_sink_cap_ext  ) \
+    X(C_R,            0,                  responder_not_support   ) \
 
-T(D0); T(Src_Cap); T(Request); T(BIST); T(Sink_Cap); T(Bat_Stat); T(Alert); T(Get_CI);
-T(Enter_USB); T(D9); T(D10); T(D11); T(D12); T(D13); T(D14); T(VDM);
-T(D_R); 
-
-static const struct PD_msg_state_t data_msg_list[] PROGMEM = {
-    {.name = str_D0,            .handler = 0,                   .responder = 0},
-    {.name = str_Src_Cap,       .handler = handler_source_cap,  .responder = responder_source_cap},
-    {.name = str_Request,       .handler = 0,                   .responder = responder_not_support},
-    {.name = str_BIST,          .handler = handler_BIST,        .responder = 0},
-    {.name = str_Sink_Cap,      .handler = 0,                   .responder = responder_not_support},
-    {.name = str_Bat_Stat,      .handler = 0,                   .responder = responder_not_support},
-    {.name = str_Alert,         .handler = handler_alert,       .responder = 0},
-    {.name = str_Get_CI,        .handler = 0,                   .responder = responder_not_support},
-    {.name = str_Enter_USB,     .handler = 0,                   .responder = 0},
-    {.name = str_D9,            .handler = 0,                   .responder = 0},
-    {.name = str_D10,           .handler = 0,                   .responder = 0},
-    {.name = str_D11,           .handler = 0,                   .responder = 0},
-    {.name = str_D12,           .handler = 0,                   .responder = 0},
-    {.name = str_D13,           .handler = 0,                   .responder = 0},
-    {.name = str_D14,           .handler = 0,                   .responder = 0},
-    {.name = str_VDM,           .handler = handler_vender_def,  .responder = responder_vender_def},
-
-    {.name = str_D_R,           .handler = 0,                   .responder = responder_not_support},
-};
+#define DATA_MSG_LIST(X) \
+    X(D0,             0,                  0                       ) \
+    X(Src_Cap,        handler_source_cap, responder_source_cap    ) \
+    X(Request,        0,                  responder_not_support   ) \
+    X(BIST,           handler_BIST,       0                       ) \
+    X(Sink_Cap,       0,                  responder_not_support   ) \
+    X(Bat_Stat,       0,                  responder_not_support   ) \
+    X(Alert,          handler_alert,      0                       ) \
+    X(Get_CI,         0,                  responder_not_support   ) \
+    X(Enter_USB,      0,                  0                       ) \
+    X(EPR_Request,    0,                  responder_not_support   ) \
+    X(EPR_Mode,       handler_EPR_mode,   0                       ) \
+    X(D11,            0,                  0                       ) \
+    X(D12,            0,                  0                       ) \
+    X(D13,            0,                  0                       ) \
+    X(D14,            0,                  0                       ) \
+    X(VDM,            handler_vender_def, responder_vender_def    ) \
+    X(D_R,            0,                  responder_not_support   ) \
+
+#define EXT_MSG_LIST(X) \
+    X(E0,             0,                  responder_not_support   ) \
+    X(Src_Cap_Ext,    handler_ext_msg,    0                       ) \
+    X(Status,         handler_status,     0                       ) \
+    X(Get_Bat_cap,    0,                  responder_not_support   ) \
+    X(Get_Bat_Stat,   0,                  responder_not_support   ) \
+    X(Bat_Cap,        handler_ext_msg,    0                       ) \
+    X(Get_Mfg_Info,   0,                  responder_not_support   ) \
+    X(Mfg_Info,       handler_ext_msg,    0                       ) \
+    X(Sec_Request,    0,                  responder_not_support   ) \
+    X(Sec_Response,   0,                  0                       ) \
+    X(FU_request,     0,                  responder_not_support   ) \
+    X(FU_Response,    0,                  0                       ) \
+    X(PPS_Stat,       handler_PPS_Status, 0                       ) \
+    X(Country_Info,   handler_ext_msg,    0                       ) \
+    X(Country_Code,   0,                  0                       ) \
+    X(Sink_Cap_Ext,   0,                  responder_not_support   ) \
+    X(Ext_Control,    0,                  responder_ext_control   ) \
+    X(EPR_Src_Cap,    handler_EPR_src_cap,responder_EPR_src_cap   ) \
+    X(E_R,            0,                  responder_not_support   ) \
+
+#define MSG_NAME(n, h, r)       static const char str_ ## n [] PROGMEM = #n;
+#define MSG_STATE(n, h, r)      {.name = str_ ## n, .handler = h, .responder = r},
+
+CTRL_MSG_LIST(MSG_NAME)
+DATA_MSG_LIST(MSG_NAME)
+EXT_MSG_LIST(MSG_NAME)
+
+static const struct PD_msg_state_t ctrl_msg_list[] PROGMEM = { CTRL_MSG_LIST(MSG_STATE) };
+static const struct PD_msg_state_t data_msg_list[] PROGMEM = { DATA_MSG_LIST(MSG_STATE) };
+static const struct PD_msg_state_t ext_msg_list[] PROGMEM = { EXT_MSG_LIST(MSG_STATE) };
+
+/* States of an extended message in progress, not a message type of its own */
+static const char str_Chunk[] PROGMEM = "Chunk";
+static const struct PD_msg_state_t chunk_rx_state PROGMEM = {.name = str_Chunk, .handler = 0, .responder = responder_chunk_request};
+static const struct PD_msg_state_t chunk_tx_state PROGMEM = {.name = str_Chunk, .handler = 0, .responder = responder_chunk};
 
-T(E0); T(Src_Cap_Ext); T(Status); T(Get_Bat_cap); T(Get_Bat_Stat); T(Bat_Cap); T(Get_Mfg_Info); T(Mfg_Info);
-T(Sec_Request); T(Sec_Response); T(FU_request); T(FU_Response); T(PPS_Stat); T(Country_Info); T(Country_Code); T(Sink_Cap_Ext);
-T(E_R);
-
-static const struct PD_msg_state_t ext_msg_list[] PROGMEM = {
-    {.name = str_E0,            .handler = 0,                   .responder = responder_not_support},
-    {.name = str_Src_Cap_Ext,   .handler = 0,                   .responder = 0},
-    {.name = str_Status,        .handler = 0,                   .responder = 0},
-    {.name = str_Get_Bat_cap,   .handler = 0,                   .responder = responder_not_support},
-    {.name = str_Get_Bat_Stat,  .handler = 0,                   .responder = responder_not_support},
-    {.name = str_Bat_Cap,       .handler = 0,                   .responder = 0},
-    {.name = str_Get_Mfg_Info,  .handler = 0,                   .responder = responder_not_support},
-    {.name = str_Mfg_Info,      .handler = 0,                   .responder = 0},
-    {.name = str_Sec_Request,   .handler = 0,                   .responder = responder_not_support},
-    {.name = str_Sec_Response,  .handler = 0,                   .responder = 0},
-    {.name = str_FU_request,    .handler = 0,                   .responder = responder_not_support},
-    {.name = str_FU_Response,   .handler = 0,                   .responder = 0},
-    {.name = str_PPS_Stat,      .handler = handler_PPS_Status,  .responder = 0},
-    {.name = str_Country_Info,  .handler = 0,                   .responder = 0},
-    {.name = str_Country_Code,  .handler = 0,                   .responder = 0},
-    {.name = str_Sink_Cap_Ext,  .handler = 0,                   .responder = responder_not_support},
-
-    {.name = str_E_R,           .handler = 0,                   .responder = responder_not_support},
+/* Structured VDM commands answered from PD_VDM_table_t, indexed by command. Return PD_VDM_REQ if not
+   in table, then the callback is asked */
+typedef uint8_t (*PD_VDM_responder_t)(const PD_VDM_table_t * t, uint32_t vdm_header, uint32_t * vdo, uint8_t * count);
+
+static uint8_t VDM_discover_identity(const PD_VDM_table_t * t, uint32_t vdm_header, uint32_t * vdo, uint8_t * count);
+static uint8_t VDM_discover_SVIDs   (const PD_VDM_table_t * t, uint32_t vdm_header, uint32_t * vdo, uint8_t * count);
+static uint8_t VDM_discover_modes   (const PD_VDM_table_t * t, uint32_t vdm_header, uint32_t * vdo, uint8_t * count);
+
+static const PD_VDM_responder_t VDM_cmd_list[] PROGMEM = {
+    [PD_VDM_CMD_DISCOVER_IDENTITY] = VDM_discover_identity,
+    [PD_VDM_CMD_DISCOVER_SVIDS] = VDM_discover_SVIDs,
+    [PD_VDM_CMD_DISCOVER_MODES] = VDM_discover_modes,
 };
 
-static const PD_power_option_setting_t power_option_setting[8] = {
-    {.limit = 25,   .use_voltage = 1, .use_current = 0},    /* PD_POWER_OPTION_MAX_5V */
-    {.limit = 45,   .use_voltage = 1, .use_current = 0},    /* PD_POWER_OPTION_MAX_9V */
-    {.limit = 60,   .use_voltage = 1, .use_current = 0},    /* PD_POWER_OPTION_MAX_12V */
-    {.limit = 75,   .use_voltage = 1, .use_current = 0},    /* PD_POWER_OPTION_MAX_15V */
-    {.limit = 100,  .use_voltage = 1, .use_current = 0},    /* PD_POWER_OPTION_MAX_20V */
-    {.limit = 100,  .use_voltage = 1, .use_current = 0},    /* PD_POWER_OPTION_MAX_VOLTAGE */
-    {.limit = 125,  .use_voltage = 0, .use_current = 1},    /* PD_POWER_OPTION_MAX_CURRENT */
-    {.limit = 12500,.use_voltage = 1, .use_current = 1},    /* PD_POWER_OPTION_MAX_POWER */  
+/* Power option presets of PD_power_policy_t, in order of enum PD_power_option_t */
+static const PD_power_policy_t power_option_policy[11] PROGMEM = {
+    {.min_v = 0, .max_v = PD_V(5),  .min_i = 0, .min_p = 0, .objective = PD_POLICY_MAX_VOLTAGE}, /* PD_POWER_OPTION_MAX_5V */
+    {.min_v = 0, .max_v = PD_V(9),  .min_i = 0, .min_p = 0, .objective = PD_POLICY_MAX_VOLTAGE}, /* PD_POWER_OPTION_MAX_9V */
+    {.min_v = 0, .max_v = PD_V(12), .min_i = 0, .min_p = 0, .objective = PD_POLICY_MAX_VOLTAGE}, /* PD_POWER_OPTION_MAX_12V */
+    {.min_v = 0, .max_v = PD_V(15), .min_i = 0, .min_p = 0, .objective = PD_POLICY_MAX_VOLTAGE}, /* PD_POWER_OPTION_MAX_15V */
+    {.min_v = 0, .max_v = PD_V(20), .min_i = 0, .min_p = 0, .objective = PD_POLICY_MAX_VOLTAGE}, /* PD_POWER_OPTION_MAX_20V */
+    {.min_v = 0, .max_v = PD_V(20), .min_i = 0, .min_p = 0, .objective = PD_POLICY_MAX_VOLTAGE}, /* PD_POWER_OPTION_MAX_VOLTAGE */
+    {.min_v = 0, .max_v = PD_V(20), .min_i = 0, .min_p = 0, .objective = PD_POLICY_MAX_CURRENT}, /* PD_POWER_OPTION_MAX_CURRENT */
+    {.min_v = 0, .max_v = PD_V(20), .min_i = 0, .min_p = 0, .objective = PD_POLICY_MAX_POWER},   /* PD_POWER_OPTION_MAX_POWER */
+    {.min_v = 0, .max_v = PD_V(28), .min_i = 0, .min_p = 0, .objective = PD_POLICY_MAX_VOLTAGE}, /* PD_POWER_OPTION_MAX_28V */
+    {.min_v = 0, .max_v = PD_V(36), .min_i = 0, .min_p = 0, .objective = PD_POLICY_MAX_VOLTAGE}, /* PD_POWER_OPTION_MAX_36V */
+    {.min_v = 0, .max_v = PD_V(48), .min_i = 0, .min_p = 0, .objective = PD_POLICY_MAX_VOLTAGE}, /* PD_POWER_OPTION_MAX_48V */
 };
 
-static uint8_t evaluate_src_cap(PD_protocol_t * p, uint16_t PPS_voltage, uint8_t PPS_current)
+static void rank_src_cap(PD_protocol_t * p)
 {
-    const PD_power_option_setting_t * setting;
+    /* Rank Fixed, Variable and Battery PDOs by power policy, best first. Exact 32-bit math,
+       voltage x current in PD_power_info_t units is power in 0.5mW units */
+    const PD_power_policy_t * policy = &p->power_policy;
+    uint32_t key[PD_PROTOCOL_MAX_NUM_OF_PDO];
+    uint16_t tie[PD_PROTOCOL_MAX_NUM_OF_PDO];
     PD_power_info_t info;
-    uint8_t option = p->power_option;
-    uint8_t selected = 0;
-
-    /* If selected option is not available, use first PDO. Reference: 6.4.1 Capabilities Message
-       The vSafe5V Fixed Supply Object Shall always be the first object. */
-    if (option >= sizeof(power_option_setting) / sizeof(power_option_setting[0])) {
-        return 0;
-    }
-
-    setting = &power_option_setting[option];
-    for (uint8_t n = 0; PD_protocol_get_power_info(p, n, &info); n++) {
-        if (info.type == PD_PDO_TYPE_AUGMENTED_PDO) {
-            uint16_t pps_v = PPS_voltage * 2;    /* Voltage in 20mV units */
-            uint16_t pps_i = PPS_current * 5;    /* Current in 50mA units */
-            /* PD_power_info_t: Voltage in 50mV units, Current in 10mA units */
-            if (info.min_v * 5 <= pps_v && pps_v <= info.max_v * 5 && pps_i <= info.max_i) {
-                return n;
-            }
+    uint8_t n, r, count = 0;
+    for (n = 0; PD_protocol_get_power_info(p, n, &info); n++) {
+        uint16_t v_min = info.min_v ? info.min_v : info.max_v, i = info.max_i, t;
+        uint32_t power = (uint32_t)info.max_v * info.max_i, k;
+        if (info.type > PD_PDO_TYPE_VARIABLE_SUPPLY || info.max_v == 0) {
+            continue;   /* APDO is used by PPS and AVS only, or unused SPR slot */
+        }
+        if (info.type == PD_PDO_TYPE_BATTERY) {
+            power = (uint32_t)info.max_p * 500;
+            i = power / info.max_v;     /* Current at max voltage */
+        }
+        if (p->cable_max_i && i > p->cable_max_i) {
+            i = p->cable_max_i;         /* Requested at cable current */
+            power = (uint32_t)info.max_v * i;
+        }
+        if (v_min < policy->min_v || info.max_v > policy->max_v || i < policy->min_i ||
+                power < (uint32_t)policy->min_p * 500) {
+            continue;
+        }
+        if (policy->score) {
+            k = policy->score(&info);
         } else {
-            uint8_t v = setting->use_voltage ? info.max_v >> 2 : 1;
-            uint8_t i = setting->use_current ? info.max_i >> 2 : 1;
-            uint16_t power = (uint16_t)v * i;  /* reduce 10-bit power info to 8-bit and use 8-bit x 8-bit multiplication */
-            if (power <= setting->limit) {
-                selected = n;
-            }
+            k = policy->objective == PD_POLICY_MAX_VOLTAGE ? info.max_v :
+                policy->objective == PD_POLICY_MAX_CURRENT ? i : power;
+        }
+        t = policy->tie == PD_POLICY_TIE_LOW_VOLTAGE ? 0xFFFF - info.max_v :
+            policy->tie == PD_POLICY_TIE_HIGH_VOLTAGE ? info.max_v :
+            policy->tie == PD_POLICY_TIE_HIGH_CURRENT ? i : 0;
+        /* Equal key and tie, the later PDO is ahead unless PD_POLICY_TIE_FIRST */
+        for (r = 0; r < count && (key[r] > k || (key[r] == k && (tie[r] > t ||
+                (tie[r] == t && policy->tie == PD_POLICY_TIE_FIRST)))); r++) {}
+        memmove(&key[r + 1], &key[r], (count - r) * sizeof(key[0]));
+        memmove(&tie[r + 1], &tie[r], (count - r) * sizeof(tie[0]));
+        memmove(&p->power_rank[r + 1], &p->power_rank[r], count - r);
+        key[r] = k;
+        tie[r] = t;
+        p->power_rank[r] = n;
+        count++;
+    }
+    p->power_rank_count = count;
+}
+
+static bool evaluate_src_cap(PD_protocol_t * p, uint16_t PPS_voltage, uint8_t PPS_current, uint8_t AVS, uint8_t * selected)
+{
+    /* Return true if an APDO fits PPS or AVS setting, otherwise select the best ranked PDO.
+       Reference: 6.4.1 Capabilities Message
+       The vSafe5V Fixed Supply Object Shall always be the first object, used if nothing is ranked */
+    PD_power_info_t info;
+    uint16_t pps_v = PPS_voltage * 2;    /* Voltage in 10mV units */
+    uint16_t pps_i = PPS_current * 5;    /* Current in 10mA units */
+    for (uint8_t n = 0; PPS_voltage && PD_protocol_get_power_info(p, n, &info); n++) {
+        /* PD_power_info_t: Voltage in 50mV units, Current in 10mA units */
+        bool fit = info.max_v && info.min_v * 5 <= pps_v && pps_v <= info.max_v * 5;
+        if (info.type == PD_PDO_TYPE_EPR_AVS) {
+            /* 20mV x 50mA = 1mW, PDP in 250mW units */
+            fit = fit && AVS && (uint32_t)PPS_voltage * PPS_current <= (uint32_t)info.max_p * 250;
+        } else if (info.type == PD_PDO_TYPE_SPR_AVS) {
+            /* Max current above 15V is in B9...0, info.max_i is up to 15V */
+            uint16_t max_i = pps_v > 1500 ? p->power_data_obj[n] & 0x3FF : info.max_i;
+            fit = fit && AVS && pps_i <= max_i;
+        } else if (info.type == PD_PDO_TYPE_AUGMENTED_PDO) {
+            fit = fit && !AVS && pps_i <= info.max_i;
+        } else {
+            fit = false;
+        }
+        if (fit && (p->cable_max_i == 0 || pps_i <= p->cable_max_i)) {
+            *selected = n;
+            return true;
         }
     }
-    return selected;
+    *selected = p->power_rank_count ? p->power_rank[0] : 0;
+    return false;
 }
 
 static void parse_header(PD_msg_header_info_t * info, uint16_t header)
@@ -236,18 +345,71 @@ static uint16_t generate_header(PD_protocol_t * p, uint8_t type, uint8_t obj_cou
     return h;
 }
 
-static uint16_t generate_header_ext(PD_protocol_t * p, uint8_t type, uint8_t data_size, uint32_t * obj)
+static uint16_t generate_header_ext(PD_protocol_t * p, uint8_t type, uint16_t data_size, uint8_t chunk, bool request,
+    uint32_t * obj)
 {
-    uint16_t h = generate_header(p, type, (data_size + 5) >> 2); /* set obj_count to fit ext header and data */
+    /* obj_count fits 2-byte extended header and data of this chunk, a chunk request has no data */
+    uint16_t len = request ? 0 : data_size - chunk * PD_EXT_CHUNK_SIZE;
+    uint16_t h = generate_header(p, type, ((len > PD_EXT_CHUNK_SIZE ? PD_EXT_CHUNK_SIZE : len) + 5) >> 2);
     h |= (uint16_t)1 << 15;     /* Set extended field */
-    /* Reference: 6.2.1.2 Extended Message Headerr */ 
-    obj[0] |= ((uint16_t)data_size << 0) |  /*   8...0  ata Size */
-              /* Assume short message, set Chunk Number and Request Chunk to 0 */
-              ((uint16_t)1 << 15);          /*      15  Chunked */
+    /* Reference: 6.2.1.2 Extended Message Header */
+    obj[0] |= ((uint32_t)(request ? 0 : data_size) << 0) |    /*   8...0  Data Size */
+              (request ? PD_EXT_HEADER_REQUEST_CHUNK : 0) |   /*      10  Request Chunk */
+              ((uint32_t)chunk << 11) |                       /*  14...11 Chunk Number */
+              PD_EXT_HEADER_CHUNKED;                          /*      15  Chunked */
     p->tx_msg_header = h;
     return h;
 }
 
+static const struct PD_msg_state_t * ext_msg_chunk(PD_protocol_t * p, uint16_t header, const uint32_t * obj,
+    const struct PD_msg_state_t * state)
+{
+    /* Reference: 6.12.2.1 Protocol Layer Message Transmission and Reception, chunking
+       Return state of the complete message, or the state sending Chunk Request / next chunk */
+    uint16_t ext = obj[0] & 0xFFFF, size = ext & PD_EXT_HEADER_DATA_SIZE_MASK, offset, i;
+    uint8_t type = header & 0x1F, chunk = (ext >> 11) & 0xF, len = ((header >> 12) & 0x7) * 4;
+    if ((ext & PD_EXT_HEADER_CHUNKED) == 0) {
+        return &ctrl_msg_list[0];   /* unchunked, not supported by FUSB302 FIFO and not advertised */
+    }
+    if (ext & PD_EXT_HEADER_REQUEST_CHUNK) {
+        /* partner requests next chunk of the message we are sending */
+        if (p->ext_msg.active && p->ext_msg.tx && p->ext_msg.type == type && chunk == p->ext_msg.chunk &&
+                chunk * PD_EXT_CHUNK_SIZE < p->ext_msg.size) {
+            return &chunk_tx_state;
+        }
+        p->ext_msg.active = 0;
+        return &ctrl_msg_list[0];
+    }
+    if (chunk == 0) {
+        p->ext_msg.active = 1;
+        p->ext_msg.type = type;
+        p->ext_msg.tx = 0;
+        p->ext_msg.size = size > PD_PROTOCOL_MAX_EXT_DATA_SIZE ? PD_PROTOCOL_MAX_EXT_DATA_SIZE : size;
+    } else if (!p->ext_msg.active || p->ext_msg.tx || p->ext_msg.type != type || chunk != p->ext_msg.chunk) {
+        p->ext_msg.active = 0;          /* out of sequence, drop the message */
+        return &ctrl_msg_list[0];
+    }
+    offset = chunk * PD_EXT_CHUNK_SIZE;
+    for (i = 2; i < len && offset < p->ext_msg.size; i++) {
+        p->ext_msg.data[offset++] = obj[i >> 2] >> ((i & 3) * 8);
+    }
+    p->ext_msg.chunk = chunk + 1;
+    return offset < p->ext_msg.size ? &chunk_rx_state : state;
+}
+
+static bool ext_msg_tx_chunk(PD_protocol_t * p, uint16_t * header, uint32_t * obj)
+{
+    /* Fill one chunk of p->ext_msg.data, at most 7 data objects */
+    uint16_t offset = p->ext_msg.chunk * PD_EXT_CHUNK_SIZE, i;
+    memset(obj, 0, 7 * 4);
+    *header = generate_header_ext(p, p->ext_msg.type, p->ext_msg.size, p->ext_msg.chunk, false, obj);
+    for (i = 2; i < 2 + PD_EXT_CHUNK_SIZE && offset < p->ext_msg.size; i++) {
+        obj[i >> 2] |= (uint32_t)p->ext_msg.data[offset++] << ((i & 3) * 8);
+    }
+    p->ext_msg.chunk++;
+    return true;
+}
+
 static void handler_good_crc(PD_protocol_t * p, uint16_t header, uint32_t * obj, PD_protocol_event_t * events)
 {
     /* Reference: 6.2.1.3 Message ID 
@@ -293,7 +455,50 @@ static void handler_source_cap(PD_protocol_t * p, uint16_t header, uint32_t * ob
     for (uint8_t i = 0; i < h.num_of_obj; i++) {
         p->power_data_obj[i] = obj[i];
     }
-    p->power_data_obj_selected = evaluate_src_cap(p, p->PPS_voltage, p->PPS_current);
+    rank_src_cap(p);
+    evaluate_src_cap(p, p->PPS_voltage, p->PPS_current, p->AVS, &p->power_data_obj_selected);
+    if (events) {
+        *events |= PD_PROTOCOL_EVENT_SRC_CAP;
+    }
+}
+
+static void handler_EPR_mode(PD_protocol_t * p, uint16_t header, uint32_t * obj, PD_protocol_event_t * events)
+{
+    /* Reference: 6.4.10 EPR_Mode Message, B31...24 Action */
+    uint8_t action = obj[0] >> 24;
+    if (action == PD_EPR_MODE_ENTER_ACK) {
+        return;     /* Enter Succeeded or Failed follows */
+    }
+    if (action == PD_EPR_MODE_ENTER_SUCCEEDED) {
+        p->EPR_state = PD_EPR_STATE_ON;
+    } else if (action == PD_EPR_MODE_ENTER_FAILED) {
+        p->EPR_state = PD_EPR_STATE_FAILED;
+    } else {
+        p->EPR_state = PD_EPR_STATE_OFF;     /* Exit, source sends Source_Capabilities next */
+    }
+    if (events) {
+        *events |= PD_PROTOCOL_EVENT_EPR_MODE;
+    }
+}
+
+static void handler_EPR_src_cap(PD_protocol_t * p, uint16_t header, uint32_t * obj, PD_protocol_event_t * events)
+{
+    /* Reassembled data in ext_msg, 7 SPR PDO slots padded with zero followed by EPR PDOs.
+       Reference: 6.5.15.1 EPR Source Capabilities Message */
+    uint8_t i, count = p->ext_msg.size / 4;
+    if (p->EPR_state != PD_EPR_STATE_ON) {
+        return;
+    }
+    if (count > PD_PROTOCOL_MAX_NUM_OF_PDO) {
+        count = PD_PROTOCOL_MAX_NUM_OF_PDO;
+    }
+    for (i = 0; i < count; i++) {
+        const uint8_t * d = &p->ext_msg.data[i * 4];
+        p->power_data_obj[i] = ((uint32_t)d[3] << 24) | ((uint32_t)d[2] << 16) | ((uint32_t)d[1] << 8) | d[0];
+    }
+    p->power_data_obj_count = count;
+    rank_src_cap(p);
+    evaluate_src_cap(p, p->PPS_voltage, p->PPS_current, p->AVS, &p->power_data_obj_selected);
     if (events) {
         *events |= PD_PROTOCOL_EVENT_SRC_CAP;
     }
@@ -306,21 +511,44 @@ static void handler_BIST(PD_protocol_t * p, uint16_t header, uint32_t * obj, PD_
 
 static void handler_alert(PD_protocol_t * p, uint16_t header, uint32_t * obj, PD_protocol_event_t * events)
 {
-    // TODO: implement alert
+    /* Reference: 6.4.6 Alert Message, B31...24 Type of Alert */
+    p->ADO = obj[0];
+    if (events) {
+        *events |= PD_PROTOCOL_EVENT_ALERT;
+    }
+}
+
+static void handler_ext_msg(PD_protocol_t * p, uint16_t header, uint32_t * obj, PD_protocol_event_t * events)
+{
+    /* Reassembled data is read by PD_protocol_get_ext_msg */
+    if (events) {
+        *events |= PD_PROTOCOL_EVENT_EXT_MSG;
+    }
 }
 
 static void handler_vender_def(PD_protocol_t * p, uint16_t header, uint32_t * obj, PD_protocol_event_t * events)
 {
-    // TODO: implement VDM parsing
+    /* Answered by responder_vender_def */
+    p->VDM_msg.count = (header >> 12) & 0x7;
+    memcpy(p->VDM_msg.obj, obj, p->VDM_msg.count * 4);
+}
+
+static void handler_status(PD_protocol_t * p, uint16_t header, uint32_t * obj, PD_protocol_event_t * events)
+{
+    /* Reassembled data in ext_msg, Power State Change byte of PD3.1 is not kept */
+    uint8_t size = p->ext_msg.size < sizeof(p->SDB) ? p->ext_msg.size : sizeof(p->SDB);
+    memset(p->SDB, 0, sizeof(p->SDB));
+    memcpy(p->SDB, p->ext_msg.data, size);
+    handler_ext_msg(p, header, obj, events);
+    if (events) {
+        *events |= PD_PROTOCOL_EVENT_STATUS;
+    }
 }
 
 static void handler_PPS_Status(PD_protocol_t * p, uint16_t header, uint32_t * obj, PD_protocol_event_t * events)
 {
-    /* Handle chunked Extended message,  Offset 2 byte for Extended Message Header */
-    p->PPSSDB[0] = (obj[0] >> 16) & 0xFF;
-    p->PPSSDB[1] = (obj[0] >> 24) & 0xFF;
-    p->PPSSDB[2] = (obj[1] >>  0) & 0xFF;
-    p->PPSSDB[3] = (obj[1] >>  8) & 0xFF;
+    /* Reassembled data in ext_msg */
+    memcpy(p->PPSSDB, p->ext_msg.data, sizeof(p->PPSSDB));
     if (events) {
         *events |= PD_PROTOCOL_EVENT_PPS_STATUS;
     }
@@ -328,13 +556,19 @@ static void handler_PPS_Status(PD_protocol_t * p, uint16_t header, uint32_t * ob
 
 static bool responder_get_sink_cap(PD_protocol_t * p, uint16_t * header, uint32_t * obj)
 {
+    if (p->sink_cap_count) {
+        /* Packed by PD_protocol_set_sink_cap */
+        memcpy(obj, p->sink_cap, p->sink_cap_count * 4);
+        *header = generate_header(p, PD_DATA_MSG_TYPE_SINK_CAP, p->sink_cap_count);
+        return true;
+    }
     /* Reference: 6.4.1.2.3 Sink Fixed Supply Power Data Object */
     uint32_t data = ((uint32_t)100 << 0) |                        /* B9...0     Operational Current in 10mA units */
                     ((uint32_t)100 << 10) |                       /* B19...10   Voltage in 50mV units */
                     ((uint32_t)1 << 26) |                         /* B26        USB Communications Capable */
                     ((uint32_t)1 << 28) |                         /* B28        Higher Capability */
                     ((uint32_t)PD_PDO_TYPE_FIXED_SUPPLY << 30);   /* B31...30   Fixed supply */
-    *obj = data; /* Only implement 5V 1A Fix supply PDO. Source rarely request sink cap */
+    *obj = data; /* Default 5V 1A Fix supply PDO */
     *header = generate_header(p, PD_DATA_MSG_TYPE_SINK_CAP, 1);
     return true;
 }
@@ -343,44 +577,46 @@ static bool responder_sink_cap_ext(PD_protocol_t * p, uint16_t * header, uint32_
 {
     /* Reference: 6.5.13 Sink_Capabilities_Extended Message 
                   6.12.3 Applicability of Extended Messages  (Normative; Shall be supported) */
-    #define SINK_CAP_VID                0
-    #define SINK_CAP_PID                0
-    #define SINK_CAP_XID                0       /* If the vendor does not have an XID, then it Shall return zero */
-    #define SINK_CAP_FW_Version         1
-    #define SINK_CAP_HW_Version         1
-    #define SINK_CAP_SKEDB_Version      1
-    #define SINK_CAP_SINK_MODE          0x3     /* Bit 0: PPS charging supported, Bit 1: VBUS powered */
-    #define SINK_CAP_SINK_MIN_PDP       5       /* Minimum     PD Power in Watt */
-    #define SINK_CAP_SINK_OP_PDP        5       /* Operational PD Power in Watt */
-    #define SINK_CAP_SINK_MAX_PDP       100     /* Maximum     PD Power in Watt */
-    static const uint32_t SKEDB[6] PROGMEM = { /* 2-byte header + 21-byte data, chunked to 6 PDO */
-    /* PDO[0], data byte  0...1  */
-        /* 16-bit LSB is reserved for Extended Message Header */
-        ((uint32_t)SINK_CAP_VID << 16),             /* Byte  0...1  VID */
-    /* PDO[1], data byte  2...5  */
-        ((uint32_t)SINK_CAP_PID << 0) |             /* Byte  2...3  PID */
-        (((uint32_t)SINK_CAP_XID & 0xFF) << 16),    /* Byte  4...5  XID */
-    /* PDO[2], data byte  6...9  */
-        (((uint32_t)SINK_CAP_XID >> 16) << 0) |     /* Byte  6...7  XID */
-        ((uint32_t)SINK_CAP_FW_Version << 16) |     /* Byte      8  FW Version */
-        ((uint32_t)SINK_CAP_HW_Version << 24),      /* Byte      9  HW Version */
-    /* PDO[3], data byte 10...13 */
-        ((uint32_t)SINK_CAP_SKEDB_Version << 0),    /* Byte     10  SKEDB Version */
-        /* Not set Byte 11 Load Step, Byte 13..12 Sink Load Characteristics */
-    /* PDO[4], data byte 14...17 */
-        /* Not set Byte 14 Compliance, Byte 15 Touch Temp, Byte 16 Battery Info */
-        ((uint32_t)SINK_CAP_SINK_MODE << 24),       /* Byte     17  Sink Modes */
-    /* PDO[5], data byte 18...20 */
-        ((uint32_t)SINK_CAP_SINK_MIN_PDP << 0) |    /* Byte     18  Minimum PDP */
-        ((uint32_t)SINK_CAP_SINK_OP_PDP << 8) |     /* Byte     19  Operational PDP */
-        ((uint32_t)SINK_CAP_SINK_MAX_PDP << 16)     /* Byte     20  Maximum PDP */
+    static const PD_sink_cap_ext_t SKEDB_default PROGMEM = {
+        .VID = 0, .PID = 0, .XID = 0,           /* If the vendor does not have an XID, then it Shall return zero */
+        .FW_version = 1, .HW_version = 1,
+        .sink_modes = 0x23,                     /* PPS charging, VBUS powered, AVS */
+        .min_PDP = 5, .op_PDP = 5, .max_PDP = 100,
+        .EPR_min_PDP = 0, .EPR_op_PDP = PD_EPR_SINK_PDP, .EPR_max_PDP = PD_EPR_SINK_PDP,
     };
-    uint8_t i;
-    for (i = 0; i < 6; i++) {
-        COPY_PDO(obj[i], SKEDB[i]);
+    PD_sink_cap_ext_t e;
+    uint8_t d[PD_SINK_CAP_EXT_SIZE];
+    if (p->sink_cap_ext) {
+        e = *p->sink_cap_ext;
+    } else {
+        COPY_STRUCT(e, SKEDB_default);
     }
-    *header = generate_header_ext(p, PD_EXT_MSG_TYPE_SINK_CAP_EXT, 21, obj);
-    return false;
+    d[0]  = e.VID;                      /* Byte  0...1  VID */
+    d[1]  = e.VID >> 8;
+    d[2]  = e.PID;                      /* Byte  2...3  PID */
+    d[3]  = e.PID >> 8;
+    d[4]  = e.XID;                      /* Byte  4...7  XID */
+    d[5]  = e.XID >> 8;
+    d[6]  = e.XID >> 16;
+    d[7]  = e.XID >> 24;
+    d[8]  = e.FW_version;               /* Byte      8  FW Version */
+    d[9]  = e.HW_version;               /* Byte      9  HW Version */
+    d[10] = 1;                          /* Byte     10  SKEDB Version 1.0 */
+    d[11] = e.load_step;                /* Byte     11  Load Step */
+    d[12] = e.load_characteristics;     /* Byte 12...13 Sink Load Characteristics */
+    d[13] = e.load_characteristics >> 8;
+    d[14] = e.compliance;               /* Byte     14  Compliance */
+    d[15] = e.touch_temp;               /* Byte     15  Touch Temp */
+    d[16] = e.battery_info;             /* Byte     16  Battery Info */
+    d[17] = e.sink_modes;               /* Byte     17  Sink Modes */
+    d[18] = e.min_PDP;                  /* Byte     18  Sink Minimum PDP */
+    d[19] = e.op_PDP;                   /* Byte     19  Sink Operational PDP */
+    d[20] = e.max_PDP;                  /* Byte     20  Sink Maximum PDP */
+    d[21] = e.EPR_min_PDP;              /* Byte     21  EPR Sink Minimum PDP, USB PD 3.1 */
+    d[22] = e.EPR_op_PDP;               /* Byte     22  EPR Sink Operational PDP */
+    d[23] = e.EPR_max_PDP;              /* Byte     23  EPR Sink Maximum PDP */
+    /* 24 bytes fit one chunk */
+    return PD_protocol_create_ext_msg(p, PD_EXT_MSG_TYPE_SINK_CAP_EXT, d, sizeof(d), header, obj);
 }
 
 static bool responder_reject(PD_protocol_t * p, uint16_t * header, uint32_t * obj)
@@ -395,69 +631,230 @@ static bool responder_not_support(PD_protocol_t * p, uint16_t * header, uint32_t
     return true;
 }
 
+static bool responder_chunk_request(PD_protocol_t * p, uint16_t * header, uint32_t * obj)
+{
+    *obj = 0;
+    *header = generate_header_ext(p, p->ext_msg.type, 0, p->ext_msg.chunk, true, obj);
+    return true;
+}
+
+static bool responder_chunk(PD_protocol_t * p, uint16_t * header, uint32_t * obj)
+{
+    return ext_msg_tx_chunk(p, header, obj);
+}
+
+static bool responder_EPR_src_cap(PD_protocol_t * p, uint16_t * header, uint32_t * obj)
+{
+    return p->EPR_state == PD_EPR_STATE_ON && responder_source_cap(p, header, obj);
+}
+
+static bool responder_ext_control(PD_protocol_t * p, uint16_t * header, uint32_t * obj)
+{
+    /* EPR_KeepAlive_Ack needs no response, EPR_Get_Source_Cap and EPR_Get_Sink_Cap are not supported */
+    return p->ext_msg.data[0] != PD_EXT_CONTROL_EPR_KEEPALIVE_ACK && responder_not_support(p, header, obj);
+}
+
 static bool responder_soft_reset(PD_protocol_t * p, uint16_t * header, uint32_t * obj)
 {
     *header = generate_header(p, PD_CONTROL_MSG_TYPE_ACCEPT, 0);
     return true;
 }
 
+static bool EPR_wanted(PD_protocol_t * p)
+{
+    /* EPR power option or AVS above SPR range set by application */
+    return p->power_policy.max_v > PD_V(20.0) || (p->AVS && p->PPS_voltage > PPS_V(20.0));
+}
+
 static bool responder_source_cap(PD_protocol_t * p, uint16_t * header, uint32_t * obj)
 {
     PD_power_info_t info;
+    /* B22 EPR Mode Capable only if EPR is enabled, otherwise the source may offer EPR the sink does not use */
+    uint32_t EPR_capable = (uint32_t)(EPR_wanted(p) || p->EPR_state != PD_EPR_STATE_OFF) << 22;
     uint32_t data, pos = p->power_data_obj_selected + 1;
     PD_protocol_get_power_info(p, p->power_data_obj_selected, &info);
     /* Reference: 6.4.2 Request Message */
-    if (info.type == PD_PDO_TYPE_AUGMENTED_PDO) {
+    if (info.type == PD_PDO_TYPE_EPR_AVS || info.type == PD_PDO_TYPE_SPR_AVS) {
+        uint32_t v = (uint32_t)p->PPS_voltage * 4 / 5 & ~(uint32_t)3;
+        data = ((uint32_t)p->PPS_current << 0) |    /* B6 ...0    Operating Current 50mA units */
+               (v << 9) |                           /* B20...9    Output Voltage in 25mV units, 100mV step */
+               EPR_capable         |                /* B22        EPR Mode Capable */
+               ((uint32_t)1 << 25) |                /* B25        USB Communication Capable */
+               ((uint32_t)pos << 28);               /* B31...28   Object position */
+    } else if (info.type == PD_PDO_TYPE_AUGMENTED_PDO) {
         /* NOTE: To compatible PD2.0 PHY, do not set Unchunked Extended Messages Supported */
         data = ((uint32_t)p->PPS_current << 0) |    /* B6 ...0    Operating Current 50mA units */
                ((uint32_t)p->PPS_voltage << 9) |    /* B19...9    Output Voltage in 20mV units */
+               EPR_capable         |                /* B22        EPR Mode Capable */
                ((uint32_t)1 << 25) |                /* B25        USB Communication Capable */
-               ((uint32_t)pos << 28);               /* B30...28   Object position (000b is Reserved and Shall Not be used) */
+               ((uint32_t)pos << 28);               /* B31...28   Object position (0000b is Reserved and Shall Not be used) */
     } else {
         uint32_t req = info.max_i ? info.max_i : info.max_p;
+        /* Cable current limit, as power at max voltage for Battery PDO */
+        uint32_t limit = info.max_i ? p->cable_max_i : (uint32_t)info.max_v * p->cable_max_i / 500;
+        if (p->cable_max_i && req > limit) {
+            req = limit;
+        }
         data = ((uint32_t)req << 0) |    /* B9 ...0    Max Operating Current 10mA units / Max Operating Power in 250mW units */
                ((uint32_t)req << 10) |   /* B19...10   Operating Current 10mA units / Operating Power in 250mW units */
+               EPR_capable         |     /* B22        EPR Mode Capable */
                ((uint32_t)1 << 25) |     /* B25        USB Communication Capable */
-               ((uint32_t)pos << 28);    /* B30...28   Object position (000b is Reserved and Shall Not be used) */
+               ((uint32_t)pos << 28);    /* B31...28   Object position (0000b is Reserved and Shall Not be used) */
+    }
+    obj[0] = data;
+    if (p->EPR_state == PD_EPR_STATE_ON) {
+        /* Reference: 6.4.9 EPR_Request Message, RDO followed by a copy of the requested PDO */
+        obj[1] = p->power_data_obj[p->power_data_obj_selected];
+        *header = generate_header(p, PD_DATA_MSG_TYPE_EPR_REQUEST, 2);
+    } else {
+        *header = generate_header(p, PD_DATA_MSG_TYPE_REQUEST, 1);
     }
-    *obj = data;
-    *header = generate_header(p, PD_DATA_MSG_TYPE_REQUEST, 1);
     return true;
 }
 
+static uint8_t VDM_discover_identity(const PD_VDM_table_t * t, uint32_t vdm_header, uint32_t * vdo, uint8_t * count)
+{
+    if ((vdm_header >> 16) != PD_VDM_SVID_PD_SID) {
+        return PD_VDM_REQ;
+    }
+    *count = t->identity_count > PD_VDM_MAX_VDO ? PD_VDM_MAX_VDO : t->identity_count;
+    memcpy(vdo, t->identity, *count * 4);
+    return *count ? PD_VDM_ACK : PD_VDM_NAK;
+}
+
+static uint8_t VDM_discover_SVIDs(const PD_VDM_table_t * t, uint32_t vdm_header, uint32_t * vdo, uint8_t * count)
+{
+    /* Reference: 6.4.4.3.2 Discover SVIDs, two SVIDs per VDO, the list ends with 0x0000 */
+    uint8_t n = t->SVID_count > PD_VDM_MAX_SVID ? PD_VDM_MAX_SVID : t->SVID_count;
+    if ((vdm_header >> 16) != PD_VDM_SVID_PD_SID) {
+        return PD_VDM_REQ;
+    }
+    *count = n ? n / 2 + 1 : 0;
+    memset(vdo, 0, *count * 4);
+    for (uint8_t i = 0; i < n; i++) {
+        vdo[i / 2] |= (uint32_t)t->SVID[i].SVID << (i & 1 ? 0 : 16);
+    }
+    return n ? PD_VDM_ACK : PD_VDM_NAK;
+}
+
+static uint8_t VDM_discover_modes(const PD_VDM_table_t * t, uint32_t vdm_header, uint32_t * vdo, uint8_t * count)
+{
+    for (uint8_t i = 0; i < t->SVID_count; i++) {
+        const PD_VDM_SVID_t * s = &t->SVID[i];
+        if (s->SVID == (vdm_header >> 16)) {
+            *count = s->mode_count > PD_VDM_MAX_VDO ? PD_VDM_MAX_VDO : s->mode_count;
+            memcpy(vdo, s->mode, *count * 4);
+            return *count ? PD_VDM_ACK : PD_VDM_NAK;
+        }
+    }
+    return PD_VDM_REQ;
+}
+
 static bool responder_vender_def(PD_protocol_t * p, uint16_t * header, uint32_t * obj)
 {
-    // TODO: implement VDM respond
-    return false;
+    /* Reference: 6.4.4.2 Structured VDM
+       B31...16  SVID, B15 Structured, B14...13 Version, B10...8 Object Position, B7...6 Command Type, B4...0 Command */
+    const PD_VDM_table_t * t = p->VDM_table;
+    PD_VDM_responder_t responder = 0;
+    uint32_t h = p->VDM_msg.obj[0], ver = (h >> 13) & 0x3;
+    uint8_t cmd = h & 0x1F, type = PD_VDM_REQ, count = 0;
+    if (p->VDM_msg.count == 0) {
+        return false;
+    }
+    if (((h >> 15) & 0x1) == 0) {
+        /* Unstructured VDM is Not_Supported in PD3.0, ignored in PD2.0 */
+        return PD_protocol_get_spec_rev(p) >= 2 && responder_not_support(p, header, obj);
+    }
+    if (((h >> 6) & 0x3) != PD_VDM_REQ) {
+        return false;   /* ACK, NAK and BUSY need no response */
+    }
+    if (cmd < sizeof(VDM_cmd_list) / sizeof(VDM_cmd_list[0])) {
+        responder = (PD_VDM_responder_t)READ_PTR(VDM_cmd_list[cmd]);
+    }
+    if (t && responder) {
+        type = responder(t, h, &obj[1], &count);
+    }
+    if (type == PD_VDM_REQ && t && t->callback) {
+        type = t->callback(p->VDM_msg.obj, p->VDM_msg.count, &obj[1], &count);
+    } else if (type == PD_VDM_REQ && cmd != PD_VDM_CMD_ATTENTION) {
+        type = PD_VDM_NAK;
+    }
+    if (type == PD_VDM_REQ) {
+        return false;   /* Attention, or no response from callback */
+    }
+    if (type != PD_VDM_ACK) {
+        count = 0;
+    } else if (count > PD_VDM_MAX_VDO) {
+        count = PD_VDM_MAX_VDO;
+    }
+    /* Same SVID, Object Position and Command. Version 2.0 unless request is 1.0 */
+    obj[0] = (h & 0xFFFF871F) | ((ver > 1 ? 1 : ver) << 13) | ((uint32_t)type << 6);
+    *header = generate_header(p, PD_DATA_MSG_TYPE_VENDOR_DEFINED, count + 1);
+    return true;
 }
 
-void PD_protocol_handle_msg(PD_protocol_t * p, uint16_t header, uint32_t * obj, PD_protocol_event_t * events)
+static const struct PD_msg_state_t * msg_state_of(uint16_t header, const PD_msg_header_info_t * h)
 {
     #define EXT_MSG_LIMIT   (sizeof(ext_msg_list) / sizeof(ext_msg_list[0]) - 1)
     #define DATA_MSG_LIMIT  (sizeof(data_msg_list) / sizeof(data_msg_list[0]) - 1)
     #define CTRL_MSG_LIMIT  (sizeof(ctrl_msg_list) / sizeof(ctrl_msg_list[0]) - 1)
+    if ((header >> 15) & 0x1) {
+        return &ext_msg_list[h->type > EXT_MSG_LIMIT ? EXT_MSG_LIMIT : h->type];
+    } else if (h->num_of_obj) {
+        return &data_msg_list[h->type > DATA_MSG_LIMIT ? DATA_MSG_LIMIT : h->type];
+    }
+    return &ctrl_msg_list[h->type > CTRL_MSG_LIMIT ? CTRL_MSG_LIMIT : h->type];
+}
 
+void PD_protocol_handle_msg(PD_protocol_t * p, uint16_t header, uint32_t * obj, PD_protocol_event_t * events)
+{
     const struct PD_msg_state_t * state;
+    PD_msg_handler_t handler;
     PD_msg_header_info_t h;
     parse_header(&h, header);
     p->rx_msg_header = header;
+    state = msg_state_of(header, &h);
     if ((header >> 15) & 0x1) {
-        state = &ext_msg_list[h.type > EXT_MSG_LIMIT ? EXT_MSG_LIMIT : h.type];
-    } else if (h.num_of_obj) {
-        state = &data_msg_list[h.type > DATA_MSG_LIMIT ? DATA_MSG_LIMIT : h.type];
-    } else {
-        state =&ctrl_msg_list[h.type > CTRL_MSG_LIMIT ? CTRL_MSG_LIMIT : h.type];
+        state = ext_msg_chunk(p, header, obj, state);
     }
-    SET_MSG_STAGE(p->msg_state, state);
-    if (p->msg_state->handler) {
-        p->msg_state->handler(p, header, obj, events);
+    p->msg_state = state;
+    handler = (PD_msg_handler_t)READ_PTR(state->handler);
+    if (handler) {
+        handler(p, header, obj, events);
+    }
+}
+
+void PD_protocol_handle_cable_msg(PD_protocol_t * p, uint16_t header, uint32_t * obj, PD_protocol_event_t * events)
+{
+    /* Reference: 6.4.4.3.1 Discover Identity, ACK from cable plug has ID Header, Cert Stat, Product and Cable VDOs.
+       ID Header B29...27 Product Type (Cable Plug): 011b Passive Cable, 100b Active Cable */
+    PD_msg_header_info_t h;
+    parse_header(&h, header);
+    p->cable_msg_header = header;
+    p->msg_state = &ctrl_msg_list[0];   /* Nothing to respond on SOP' */
+    if ((header >> 15) & 0x1) {
+        return;
+    }
+    if (h.num_of_obj == 0 && h.type == PD_CONTROL_MSG_TYPE_GOOD_CRC) {
+        p->cable_message_id = (p->cable_message_id + 1) & 0x7;
+    } else if (h.type == PD_DATA_MSG_TYPE_VENDOR_DEFINED && h.num_of_obj &&
+            (obj[0] & 0xFFFF801F) == (((uint32_t)PD_VDM_SVID_PD_SID << 16) | (1 << 15) | PD_VDM_CMD_DISCOVER_IDENTITY)) {
+        uint8_t type = (obj[0] >> 6) & 0x3, product = h.num_of_obj > 1 ? (obj[1] >> 27) & 0x7 : 0;
+        /* NAK, BUSY or no Cable VDO is a cable without known capability */
+        p->cable_vdo = type == PD_VDM_ACK && h.num_of_obj >= 5 && (product == 3 || product == 4) ? obj[4] : 0;
+        if (events) {
+            *events |= PD_PROTOCOL_EVENT_CABLE;
+        }
     }
 }
 
 bool PD_protocol_respond(PD_protocol_t * p, uint16_t * header, uint32_t * obj)
 {
-    if (p && p->msg_state && p->msg_state->responder && header && obj) {
-        return p->msg_state->responder(p, (uint16_t *)header, obj);
+    if (p && p->msg_state && header && obj) {
+        PD_msg_responder_t responder = (PD_msg_responder_t)READ_PTR(p->msg_state->responder);
+        if (responder) {
+            return responder(p, header, obj);
+        }
     }
     return false;
 }
@@ -472,11 +869,62 @@ void PD_protocol_create_get_PPS_status(PD_protocol_t *p, uint16_t *header)
     *header = generate_header(p, PD_CONTROL_MSG_TYPE_GET_PPS_STATUS, 0);
 }
 
+void PD_protocol_create_get_status(PD_protocol_t * p, uint16_t * header)
+{
+    *header = generate_header(p, PD_CONTROL_MSG_TYPE_GET_STATUS, 0);
+}
+
 void PD_protocol_create_request(PD_protocol_t * p, uint16_t * header, uint32_t * obj)
 {
     responder_source_cap(p, header, obj);
 }
 
+void PD_protocol_create_EPR_mode(PD_protocol_t * p, uint16_t * header, uint32_t * obj)
+{
+    /* Reference: 6.4.10 EPR_Mode Message, Enter with Sink Operational PDP in Watt */
+    uint8_t pdp = p->sink_cap_ext && p->sink_cap_ext->EPR_op_PDP ? p->sink_cap_ext->EPR_op_PDP : PD_EPR_SINK_PDP;
+    obj[0] = ((uint32_t)PD_EPR_MODE_ENTER << 24) | ((uint32_t)pdp << 16);
+    *header = generate_header(p, PD_DATA_MSG_TYPE_EPR_MODE, 1);
+    p->EPR_state = PD_EPR_STATE_ENTERING;
+}
+
+void PD_protocol_create_cable_discover_identity(PD_protocol_t * p, uint16_t * header, uint32_t * obj)
+{
+    /* Reference: 6.2.1.1 Message Header, SOP' has its own MessageID. B8 Cable Plug is 0 from a port,
+       B5 is Reserved on SOP' */
+    uint16_t h = ((uint16_t)PD_DATA_MSG_TYPE_VENDOR_DEFINED << 0) |   /*   4...0  Message Type */
+                 ((uint16_t)PD_SPECIFICATION_REVISION << 6) |         /*   7...6  Specification Revision */
+                 ((uint16_t)p->cable_message_id << 9) |               /*  11...9  MessageID */
+                 ((uint16_t)1 << 12);                                 /* 14...12  Number of Data Objects */
+    obj[0] = ((uint32_t)PD_VDM_SVID_PD_SID << 16) |   /* B31...16   SVID */
+             ((uint32_t)1 << 15) |                    /* B15        Structured VDM */
+             ((uint32_t)1 << 13) |                    /* B14...13   Version 2.0 */
+             PD_VDM_CMD_DISCOVER_IDENTITY;            /* B4...0     Command, REQ */
+    p->tx_msg_header = h;
+    *header = h;
+}
+
+void PD_protocol_create_EPR_keepalive(PD_protocol_t * p, uint16_t * header, uint32_t * obj)
+{
+    static const uint8_t data[2] = {PD_EXT_CONTROL_EPR_KEEPALIVE, 0};
+    PD_protocol_create_ext_msg(p, PD_EXT_MSG_TYPE_EXT_CONTROL, data, sizeof(data), header, obj);
+}
+
+bool PD_protocol_create_ext_msg(PD_protocol_t * p, uint8_t type, const uint8_t * data, uint16_t size, uint16_t * header,
+    uint32_t * obj)
+{
+    if (size > PD_PROTOCOL_MAX_EXT_DATA_SIZE) {
+        return false;
+    }
+    p->ext_msg.active = 1;
+    p->ext_msg.type = type;
+    p->ext_msg.tx = 1;
+    p->ext_msg.chunk = 0;
+    p->ext_msg.size = size;
+    memcpy(p->ext_msg.data, data, size);
+    return ext_msg_tx_chunk(p, header, obj);
+}
+
 bool PD_protocol_get_power_info(PD_protocol_t * p, uint8_t index, PD_power_info_t * power_info)
 {
     if (p && index < p->power_data_obj_count && power_info) {
@@ -505,11 +953,34 @@ bool PD_protocol_get_power_info(PD_protocol_t * p, uint8_t index, PD_power_info_
             power_info->max_p = 0;
             break;
         case PD_PDO_TYPE_AUGMENTED_PDO:
-            /* Reference: 6.4.1.3.4 Programmable Power Supply Augmented Power Data Object */
-            power_info->max_v = ((obj >> 17) & 0xFF) * 2;   /*  B24...17  Max Voltage in 100mV units */
-            power_info->min_v = ((obj >>  8) & 0xFF) * 2;   /*  B15...8   Min Voltage in 100mV units */
-            power_info->max_i = ((obj >>  0) & 0x7F) * 5;   /*  B6 ...0   Max Current in 50mA units */
-            power_info->max_p = 0;
+            /* B29...28  APDO subtype */
+            if (((obj >> 28) & 0x3) == 0) {
+                /* Reference: 6.4.1.3.4 Programmable Power Supply Augmented Power Data Object */
+                power_info->max_v = ((obj >> 17) & 0xFF) * 2;   /*  B24...17  Max Voltage in 100mV units */
+                power_info->min_v = ((obj >>  8) & 0xFF) * 2;   /*  B15...8   Min Voltage in 100mV units */
+                power_info->max_i = ((obj >>  0) & 0x7F) * 5;   /*  B6 ...0   Max Current in 50mA units */
+                power_info->max_p = 0;
+            } else if (((obj >> 28) & 0x3) == 1) {
+                /* Reference: USB PD 3.1 6.4.1.2.5 EPR Adjustable Voltage Supply APDO */
+                power_info->type = PD_PDO_TYPE_EPR_AVS;
+                power_info->max_v = ((obj >> 17) & 0x1FF) * 2; /*  B25...17  Max Voltage in 100mV units */
+                power_info->min_v = ((obj >>  8) & 0xFF) * 2;   /*  B15...8   Min Voltage in 100mV units */
+                power_info->max_i = 0;
+                power_info->max_p = ((obj >>  0) & 0xFF) * 4;   /*  B7 ...0   PDP in 1W units */
+            } else if (((obj >> 28) & 0x3) == 2) {
+                /* Reference: USB PD 3.2 6.4.1.2.6 SPR Adjustable Voltage Supply APDO, 9V minimum */
+                uint16_t max_i_20v = (obj >>  0) & 0x3FF;       /*  B9 ...0   Max Current 15V...20V in 10mA units */
+                power_info->type = PD_PDO_TYPE_SPR_AVS;
+                power_info->min_v = PD_V(9);
+                power_info->max_v = max_i_20v ? PD_V(20) : PD_V(15);
+                power_info->max_i = (obj >> 10) & 0x3FF;        /*  B19...10  Max Current 9V...15V in 10mA units */
+                power_info->max_p = 0;
+            } else {
+                memset(power_info, 0, sizeof(PD_power_info_t));
+                power_info->type = PD_PDO_TYPE_AUGMENTED_PDO;
+            }
+            break;
+        default:    /* PD_PDO_TYPE_EPR_AVS and PD_PDO_TYPE_SPR_AVS are decoded from APDO subtype */
             break;
         }
         return true;
@@ -522,13 +993,8 @@ bool PD_protocol_get_msg_info(uint16_t header, PD_msg_info_t * msg_info)
     PD_msg_header_info_t h;
     parse_header(&h, header);
     if (msg_info) {
-        const char * name;
-        const struct PD_msg_state_t * state;
-        uint8_t type = h.type;
-        SET_MSG_STAGE(state, header & 0x8000 ? &ext_msg_list[type] :
-                        h.num_of_obj ? &data_msg_list[type] : &ctrl_msg_list[type]);
-        SET_MSG_NAME(name, state->name);
-        msg_info->name = name;
+        const struct PD_msg_state_t * state = msg_state_of(header, &h);
+        msg_info->name = (const char *)READ_PTR(state->name);
         msg_info->id = h.id;
         msg_info->spec_rev = h.spec_rev;
         msg_info->num_of_obj = h.num_of_obj;
@@ -551,13 +1017,59 @@ bool PD_protocol_get_PPS_status(PD_protocol_t *p, PPS_status_t * PPS_status)
     return false;
 }
 
+bool PD_protocol_get_status(PD_protocol_t * p, PD_status_t * status)
+{
+    if (p && status) {
+        /* Reference: 6.5.2 Status Message */
+        status->internal_temp = p->SDB[0];
+        status->present_input = p->SDB[1];
+        status->present_battery_input = p->SDB[2];
+        status->event_flags = p->SDB[3];
+        status->temp_status = (p->SDB[4] >> 1) & 0x3;   /* Bit 1 ... 2 */
+        status->power_status = p->SDB[5];
+        return true;
+    }
+    return false;
+}
+
+bool PD_protocol_set_sink_cap(PD_protocol_t * p, const uint32_t * pdo, uint8_t count)
+{
+    /* Reference: 6.4.1.3 Sink Capabilities Message
+       vSafe5V Fixed Supply PDO first, other PDOs in the same order as Source_Capabilities */
+    if (count > PD_PROTOCOL_MAX_NUM_OF_SINK_PDO ||
+            (count && (pdo[0] >> 30 != PD_PDO_TYPE_FIXED_SUPPLY || ((pdo[0] >> 10) & 0x3FF) != PD_V(5)))) {
+        return false;
+    }
+    memcpy(p->sink_cap, pdo, count * 4);
+    p->sink_cap_count = count;
+    if (count) {
+        p->sink_cap[0] |= ((uint32_t)1 << 26) |                   /* B26        USB Communications Capable */
+                          ((uint32_t)(count > 1) << 28);          /* B28        Higher Capability */
+    }
+    return true;
+}
+
 bool PD_protocol_set_power_option(PD_protocol_t * p, enum PD_power_option_t option)
 {
+    PD_power_policy_t policy;
+    if ((uint8_t)option < sizeof(power_option_policy) / sizeof(power_option_policy[0])) {
+        COPY_STRUCT(policy, power_option_policy[option]);
+    } else {
+        memset(&policy, 0, sizeof(policy));     /* Nothing qualifies, use first PDO */
+    }
     p->power_option = option;
+    return PD_protocol_set_power_policy(p, &policy);
+}
+
+bool PD_protocol_set_power_policy(PD_protocol_t * p, const PD_power_policy_t * policy)
+{
+    p->power_policy = *policy;
     p->PPS_voltage = 0;
     p->PPS_current = 0;
+    p->AVS = 0;
     if (p->power_data_obj_count > 0) {
-        p->power_data_obj_selected = evaluate_src_cap(p, p->PPS_voltage, p->PPS_current);
+        rank_src_cap(p);
+        evaluate_src_cap(p, 0, 0, 0, &p->power_data_obj_selected);
         return true;    /* need to re-send request */
     }
     return false;
@@ -572,13 +1084,40 @@ bool PD_protocol_select_power(PD_protocol_t * p, uint8_t index)
     return false;
 }
 
+uint16_t PD_protocol_get_cable_current(PD_protocol_t * p)
+{
+    /* Reference: 6.4.4.3.1.6 Passive Cable VDO, B6...5 VBUS Current Handling: 01b 3A, 10b 5A.
+       Same field in Active Cable VDO1. A cable without e-marker is 3A */
+    return ((p->cable_vdo >> 5) & 0x3) == 2 ? PD_A(5.0) : PD_A(3.0);
+}
+
+bool PD_protocol_set_cable_current(PD_protocol_t * p, uint16_t max_i)
+{
+    uint16_t limit = p->cable_max_i && (max_i == 0 || p->cable_max_i < max_i) ? p->cable_max_i : max_i;
+    uint8_t selected = p->power_data_obj_selected;
+    PD_power_info_t info;
+    if (p->cable_max_i == max_i) {
+        return false;
+    }
+    p->cable_max_i = max_i;
+    if (p->power_data_obj_count == 0) {
+        return false;
+    }
+    rank_src_cap(p);
+    evaluate_src_cap(p, p->PPS_voltage, p->PPS_current, p->AVS, &p->power_data_obj_selected);
+    PD_protocol_get_power_info(p, selected, &info);
+    /* Re-send request if selection changed, or the selected PDO current is above the lower limit */
+    return p->power_data_obj_selected != selected || (limit && info.max_i > limit);
+}
+
 bool PD_protocol_set_PPS(PD_protocol_t * p, uint16_t PPS_voltage, uint8_t PPS_current, bool strict)
 {
-    if (p->PPS_voltage != PPS_voltage || p->PPS_current != PPS_current) {
-        uint8_t selected = evaluate_src_cap(p, PPS_voltage, PPS_current);
-        if (selected || !strict) {
+    if (p->PPS_voltage != PPS_voltage || p->PPS_current != PPS_current || p->AVS) {
+        uint8_t selected;
+        if (evaluate_src_cap(p, PPS_voltage, PPS_current, 0, &selected) || !strict) {
             p->PPS_voltage = PPS_voltage;
             p->PPS_current = PPS_current;
+            p->AVS = 0;
             p->power_data_obj_selected = selected;
             return true;    /* need to re-send request */            
         }
@@ -586,10 +1125,49 @@ bool PD_protocol_set_PPS(PD_protocol_t * p, uint16_t PPS_voltage, uint8_t PPS_cu
     return false;
 }
 
+bool PD_protocol_set_AVS(PD_protocol_t * p, uint16_t AVS_voltage, uint8_t AVS_current, bool strict)
+{
+    AVS_voltage -= AVS_voltage % 5;     /* 100mV step */
+    if (p->PPS_voltage != AVS_voltage || p->PPS_current != AVS_current || !p->AVS) {
+        uint8_t selected;
+        if (evaluate_src_cap(p, AVS_voltage, AVS_current, 1, &selected) || !strict) {
+            p->PPS_voltage = AVS_voltage;
+            p->PPS_current = AVS_current;
+            p->AVS = 1;
+            p->power_data_obj_selected = selected;
+            return true;    /* need to re-send request */
+        }
+    }
+    return false;
+}
+
+bool PD_protocol_need_EPR_mode(PD_protocol_t * p)
+{
+    /* Reference: 6.4.1.2.2 Source Fixed Supply PDO, B23 EPR Mode Capable in first PDO */
+    return EPR_wanted(p) && p->EPR_state == PD_EPR_STATE_OFF && p->power_data_obj_count &&
+        ((p->power_data_obj[0] >> 23) & 0x1);
+}
+
+bool PD_protocol_get_ext_msg(PD_protocol_t * p, uint8_t * type, const uint8_t ** data, uint16_t * size)
+{
+    if (p && p->ext_msg.active && !p->ext_msg.tx && p->ext_msg.chunk * PD_EXT_CHUNK_SIZE >= p->ext_msg.size) {
+        *type = p->ext_msg.type;
+        *data = p->ext_msg.data;
+        *size = p->ext_msg.size;
+        return true;
+    }
+    return false;
+}
+
 void PD_protocol_reset(PD_protocol_t * p)
 {
     p->msg_state = &ctrl_msg_list[0];
     p->message_id = 0;
+    p->EPR_state = PD_EPR_STATE_OFF;
+    p->ext_msg.active = 0;
+    p->VDM_msg.count = 0;
+    p->cable_message_id = 0;
+    p->cable_vdo = 0;
 }
 
 void PD_protocol_init(PD_protocol_t * p)
@@ -11,10 +11,16 @@
  * No use of bit-field for better cross-platform compatibility
  *
  * Support PD3.0 PPS
- * Do not support extended message. Not necessary for PD trigger and PPS.
+ * Support PD3.1 EPR fixed and AVS power up to 48V
+ * Support PD3.2 SPR AVS
+ * Support chunked extended message up to 260 bytes
+ * Support structured VDM Discover Identity, SVIDs and Modes responses
+ * Support SOP' Discover Identity of cable e-marker, cable current limits PDO selection
+ * Support Alert and Status
  * 
  * Reference: USB_PD_R2_0 V1.3 - 20170112
  *            USB_PD_R3_0 V2.0 20190829 + ECNs 2020-12-10
+ *            USB_PD_R3_1 V1.0 20210501
  *            - Chapter 6. Protocol Layer
  *
  */
@@ -25,23 +31,43 @@
 #include <stdbool.h>
 #include <stdint.h>
 
-/* For use in PD_protocol_get_power_info() */
+/* For use in PD_protocol_get_power_info() and PD_power_policy_t */
 #define PD_V(v)     ((uint16_t)(v * 20 + 0.01))
 #define PD_A(a)     ((uint16_t)(a * 100 + 0.01))
+#define PD_W(w)     ((uint16_t)(w * 4 + 0.01))
 
-/* For use in PD_protocol_set_PPS_option() */
+/* For use in PD_protocol_set_PPS() and PD_protocol_set_AVS() */
 #define PPS_V(v)    ((uint16_t)(v * 50 + 0.01))
 #define PPS_A(a)    ((uint8_t)(a * 20 + 0.01))
 
-#define PD_PROTOCOL_MAX_NUM_OF_PDO      7
+#define PD_PROTOCOL_MAX_NUM_OF_PDO      11      /* 7 SPR + 4 EPR in EPR_Source_Capabilities */
+#define PD_PROTOCOL_MAX_NUM_OF_SINK_PDO 7
+#ifndef PD_PROTOCOL_MAX_EXT_DATA_SIZE
+#define PD_PROTOCOL_MAX_EXT_DATA_SIZE   260     /* MaxExtendedMsgLen, per port. 48 holds every message handled here */
+#endif
 
 #define PD_PROTOCOL_EVENT_SRC_CAP       (1 << 0)
 #define PD_PROTOCOL_EVENT_PS_RDY        (1 << 1)
 #define PD_PROTOCOL_EVENT_ACCEPT        (1 << 2)
 #define PD_PROTOCOL_EVENT_REJECT        (1 << 3)
 #define PD_PROTOCOL_EVENT_PPS_STATUS    (1 << 4)
+#define PD_PROTOCOL_EVENT_EXT_MSG       (1 << 5)    /* Src_Cap_Ext, Status, Bat_Cap, Mfg_Info or Country_Info received */
+#define PD_PROTOCOL_EVENT_EPR_MODE      (1 << 6)    /* EPR mode entered, failed or exited, see PD_protocol_is_EPR_mode */
+#define PD_PROTOCOL_EVENT_CABLE         (1 << 7)    /* Cable answered SOP' Discover Identity, see PD_protocol_get_cable_current */
+#define PD_PROTOCOL_EVENT_ALERT         (1 << 8)    /* Alert received, see PD_protocol_get_alert */
+#define PD_PROTOCOL_EVENT_STATUS        (1 << 9)    /* Status received, see PD_protocol_get_status */
+
+typedef uint16_t PD_protocol_event_t;
 
-typedef uint8_t PD_protocol_event_t;
+/* Type of Alert in Alert Data Object. Reference: 6.4.6 Alert Message */
+#define PD_ALERT_BATTERY_STATUS         (1 << 1)
+#define PD_ALERT_OCP                    (1 << 2)
+#define PD_ALERT_OTP                    (1 << 3)
+#define PD_ALERT_OPERATING_CHANGE       (1 << 4)
+#define PD_ALERT_SOURCE_INPUT_CHANGE    (1 << 5)
+#define PD_ALERT_OVP                    (1 << 6)
+#define PD_ALERT_EXTENDED               (1 << 7)    /* USB PD 3.1, Extended Alert Event Type in B3...0 of ADO */
+#define PD_ALERT_FAULT                  (PD_ALERT_OCP | PD_ALERT_OTP | PD_ALERT_OVP)
 
 enum PD_power_option_t {
     PD_POWER_OPTION_MAX_5V      = 0,
@@ -52,13 +78,25 @@ enum PD_power_option_t {
     PD_POWER_OPTION_MAX_VOLTAGE = 5,
     PD_POWER_OPTION_MAX_CURRENT = 6,
     PD_POWER_OPTION_MAX_POWER   = 7,
+    PD_POWER_OPTION_MAX_28V     = 8,    /* EPR, enter EPR mode if source is EPR capable */
+    PD_POWER_OPTION_MAX_36V     = 9,    /* EPR */
+    PD_POWER_OPTION_MAX_48V     = 10,   /* EPR */
 };
 
 enum PD_power_data_obj_type_t {   /* Power data object type */
     PD_PDO_TYPE_FIXED_SUPPLY    = 0,
     PD_PDO_TYPE_BATTERY         = 1,
     PD_PDO_TYPE_VARIABLE_SUPPLY = 2,
-    PD_PDO_TYPE_AUGMENTED_PDO   = 3     /* USB PD 3.0 */
+    PD_PDO_TYPE_AUGMENTED_PDO   = 3,    /* USB PD 3.0 */
+    PD_PDO_TYPE_EPR_AVS         = 4,    /* USB PD 3.1, augmented PDO subtype, not a PDO type field value */
+    PD_PDO_TYPE_SPR_AVS         = 5     /* USB PD 3.2, augmented PDO subtype, not a PDO type field value */
+};
+
+enum PD_EPR_state_t {
+    PD_EPR_STATE_OFF            = 0,
+    PD_EPR_STATE_ENTERING       = 1,    /* EPR_Mode Enter sent */
+    PD_EPR_STATE_ON             = 2,    /* EPR_Mode Enter Succeeded, EPR_KeepAlive needed */
+    PD_EPR_STATE_FAILED         = 3     /* EPR_Mode Enter Failed, not retried until reset */
 };
 
 enum PPS_PTF_t {
@@ -80,8 +118,19 @@ typedef struct {
     enum PPS_OMF_t flag_OMF;
 } PPS_status_t;
 
+/* Status Data Block. Reference: 6.5.2 Status Message */
 typedef struct {
-    const char * name;
+    uint8_t internal_temp;      /* Source temperature in degree C, 0 if not supported */
+    uint8_t present_input;      /* B1 external power, B2 external AC, B3 internal battery, B4 internal non-battery */
+    uint8_t present_battery_input;
+    uint8_t event_flags;        /* B1 OCP, B2 OTP, B3 OVP, B4 CF mode */
+    uint8_t temp_status;        /* 0: not supported, 1: normal, 2: warning, 3: over temperature */
+    uint8_t power_status;       /* B1 cable current, B2 insufficient power, B3 insufficient external power,
+                                   B4 event flags, B5 temperature */
+} PD_status_t;
+
+typedef struct {
+    const char * name;  /* in PROGMEM on AVR, print with %S */
     uint8_t id;
     uint8_t spec_rev;
     uint8_t num_of_obj;
@@ -96,54 +145,227 @@ typedef struct {
     uint16_t max_p;     /* Power in 250mW units */
 } PD_power_info_t;
 
+enum PD_power_objective_t {
+    PD_POLICY_MAX_VOLTAGE       = 0,
+    PD_POLICY_MAX_CURRENT       = 1,
+    PD_POLICY_MAX_POWER         = 2
+};
+
+enum PD_power_tie_t {            /* Applied when objective or score is equal */
+    PD_POLICY_TIE_LAST          = 0,    /* Higher object position */
+    PD_POLICY_TIE_FIRST         = 1,    /* Lower object position */
+    PD_POLICY_TIE_LOW_VOLTAGE   = 2,
+    PD_POLICY_TIE_HIGH_VOLTAGE  = 3,
+    PD_POLICY_TIE_HIGH_CURRENT  = 4
+};
+
+/* Fixed, Variable and Battery PDO selection. A PDO qualifies if its voltage range is within
+   min_v...max_v, and it supplies at least min_i and min_p. The best qualified PDO is selected,
+   the first PDO (vSafe5V) if none qualifies */
+typedef struct {
+    uint16_t min_v;     /* Voltage in 50mV units */
+    uint16_t max_v;     /* Voltage in 50mV units, above 20V enters EPR mode */
+    uint16_t min_i;     /* Current in 10mA units */
+    uint16_t min_p;     /* Power in 250mW units */
+    uint8_t objective;  /* enum PD_power_objective_t */
+    uint8_t tie;        /* enum PD_power_tie_t */
+    uint32_t (*score)(const PD_power_info_t *info);    /* optional, replaces objective, higher is better */
+} PD_power_policy_t;
+
+/* Sink Capabilities Extended Data Block. Reference: 6.5.13 Sink_Capabilities_Extended Message */
+typedef struct {
+    uint16_t VID;
+    uint16_t PID;
+    uint32_t XID;
+    uint8_t FW_version;
+    uint8_t HW_version;
+    uint8_t load_step;              /* 0: 150mA/us, 1: 500mA/us */
+    uint16_t load_characteristics;  /* B4...0 overload %/10, B10...5 overload period 20ms, B14...11 duty cycle %/5,
+                                       B15 VBUS droop tolerated */
+    uint8_t compliance;             /* B0 LPS, B1 PS1, B2 PS2 */
+    uint8_t touch_temp;             /* 0: not applicable, 1: IEC 60950-1, 2: IEC 62368-1 TS1, 3: TS2 */
+    uint8_t battery_info;           /* B3...0 hot swappable battery slots, B7...4 fixed batteries */
+    uint8_t sink_modes;             /* B0 PPS charging, B1 VBUS powered, B2 mains powered, B3 battery powered,
+                                       B4 battery essentially unlimited, B5 AVS */
+    uint8_t min_PDP;                /* PDP in Watt */
+    uint8_t op_PDP;
+    uint8_t max_PDP;
+    uint8_t EPR_min_PDP;            /* EPR PDP in Watt, USB PD 3.1. EPR_op_PDP is also sent in EPR_Mode Enter */
+    uint8_t EPR_op_PDP;
+    uint8_t EPR_max_PDP;
+} PD_sink_cap_ext_t;
+
+/* Structured VDM command type, also returned by PD_VDM_table_t callback. Reference: 6.4.4.2 Structured VDM */
+enum PD_VDM_command_type_t {
+    PD_VDM_REQ                  = 0,    /* Callback return: no response, e.g. Attention */
+    PD_VDM_ACK                  = 1,
+    PD_VDM_NAK                  = 2,
+    PD_VDM_BUSY                 = 3
+};
+
+#define PD_VDM_SVID_PD_SID      0xFF00
+#define PD_VDM_MAX_VDO          6       /* VDOs after VDM Header */
+
+typedef struct {
+    uint16_t SVID;
+    uint8_t mode_count;         /* up to 6 */
+    const uint32_t *mode;       /* Discover Modes VDOs */
+} PD_VDM_SVID_t;
+
+/* Structured VDM responses, kept by caller. Discover Identity, SVIDs and Modes are answered from the table,
+   other commands and SVIDs go to callback, NAK if callback is 0 */
+typedef struct {
+    const uint32_t *identity;   /* ID Header, Cert Stat, Product and Product Type VDOs */
+    uint8_t identity_count;     /* up to 6, 0 to NAK Discover Identity */
+    const PD_VDM_SVID_t *SVID;
+    uint8_t SVID_count;         /* up to 11, the 0x0000 terminator takes the last slot, 0 to NAK Discover SVIDs */
+    /* vdo[0] is VDM Header, response has up to 6 VDOs after VDM Header. Return enum PD_VDM_command_type_t */
+    uint8_t (*callback)(const uint32_t *vdo, uint8_t count, uint32_t *response, uint8_t *response_count);
+} PD_VDM_table_t;
+
+/* Extended message being received or sent in chunks */
+typedef struct {
+    uint8_t active;         /* 0 if no message in progress */
+    uint8_t type;           /* extended message type */
+    uint8_t tx;             /* 1 if data is sent, 0 if received */
+    uint8_t chunk;          /* next chunk to request or send */
+    uint16_t size;          /* data size from extended message header */
+    uint8_t data[PD_PROTOCOL_MAX_EXT_DATA_SIZE];
+} PD_ext_msg_t;
+
+/* Last received VDM, read by responder right after GoodCRC is sent */
+typedef struct {
+    uint8_t count;          /* 0 if none */
+    uint32_t obj[7];        /* VDM Header and VDOs */
+} PD_VDM_msg_t;
+
 struct PD_msg_state_t;
 typedef struct {
-    const struct PD_msg_state_t *msg_state;
+    const struct PD_msg_state_t *msg_state;     /* in PROGMEM on AVR */
     uint16_t tx_msg_header;
     uint16_t rx_msg_header;
     uint8_t message_id;
 
     uint16_t PPS_voltage;
     uint8_t PPS_current;
+    uint8_t AVS;        /* PPS_voltage and PPS_current are for SPR or EPR AVS */
     uint8_t PPSSDB[4];  /* PPS Status Data Block */
+    uint8_t SDB[6];     /* Status Data Block */
+    uint32_t ADO;       /* Alert Data Object of the last Alert */
 
     enum PD_power_option_t power_option;
+    PD_power_policy_t power_policy;
+    uint8_t EPR_state;
     uint32_t power_data_obj[PD_PROTOCOL_MAX_NUM_OF_PDO];
     uint8_t power_data_obj_count;
     uint8_t power_data_obj_selected;
+    uint8_t power_rank[PD_PROTOCOL_MAX_NUM_OF_PDO];     /* qualified PDO index, best first */
+    uint8_t power_rank_count;
+    uint32_t sink_cap[PD_PROTOCOL_MAX_NUM_OF_SINK_PDO]; /* Sink_Capabilities PDOs, packed once */
+    uint8_t sink_cap_count;                             /* 0 for default 5V 1A */
+    const PD_sink_cap_ext_t *sink_cap_ext;              /* kept by caller, 0 for default */
+    const PD_VDM_table_t *VDM_table;                    /* kept by caller, 0 to NAK all structured VDMs */
+    uint8_t cable_message_id;                           /* SOP' MessageIDCounter */
+    uint16_t cable_msg_header;                          /* Last SOP' message header, spec revision stays from SOP */
+    uint32_t cable_vdo;                                 /* Passive or Active Cable VDO from e-marker, 0 if none */
+    uint16_t cable_max_i;                               /* Current limit of PDO selection in 10mA units, 0 for none */
+    PD_ext_msg_t ext_msg;                               /* Chunked extended message in progress */
+    PD_VDM_msg_t VDM_msg;
 } PD_protocol_t;
 
-/* Message handler */
+/* Message handler, SOP' messages from the cable go to PD_protocol_handle_cable_msg and need no response */
 void PD_protocol_handle_msg(PD_protocol_t *p, uint16_t header, uint32_t *obj, PD_protocol_event_t *events);
+void PD_protocol_handle_cable_msg(PD_protocol_t *p, uint16_t header, uint32_t *obj, PD_protocol_event_t *events);
 bool PD_protocol_respond(PD_protocol_t *p, uint16_t *h, uint32_t *obj);
 
 /* PD Message creation */
 void PD_protocol_create_get_src_cap(PD_protocol_t *p, uint16_t *header);
 void PD_protocol_create_get_PPS_status(PD_protocol_t *p, uint16_t *header);
+void PD_protocol_create_get_status(PD_protocol_t *p, uint16_t *header);
 void PD_protocol_create_request(PD_protocol_t *p, uint16_t *header, uint32_t *obj);
+/* EPR_Mode Enter and EPR_KeepAlive, send EPR_KeepAlive within 500ms intervals in EPR mode */
+void PD_protocol_create_EPR_mode(PD_protocol_t *p, uint16_t *header, uint32_t *obj);
+void PD_protocol_create_EPR_keepalive(PD_protocol_t *p, uint16_t *header, uint32_t *obj);
+/* Discover Identity to the cable e-marker, send on SOP' */
+void PD_protocol_create_cable_discover_identity(PD_protocol_t *p, uint16_t *header, uint32_t *obj);
+/* Extended message up to 260 bytes, obj has 7 data objects for the first chunk. Following chunks
+   are sent by PD_protocol_respond on Chunk Request */
+bool PD_protocol_create_ext_msg(PD_protocol_t *p, uint8_t type, const uint8_t *data, uint16_t size, uint16_t *header,
+    uint32_t *obj);
 
 /* Get functions */
 static inline uint8_t  PD_protocol_get_selected_power(PD_protocol_t *p) { return p->power_data_obj_selected; }
+/* Ranking by power policy, done once per Source_Capabilities and on policy change */
+static inline uint8_t  PD_protocol_get_power_rank_count(PD_protocol_t *p) { return p->power_rank_count; }
+static inline uint8_t  PD_protocol_get_power_rank(PD_protocol_t *p, uint8_t n) { return p->power_rank[n]; }
 static inline uint16_t PD_protocol_get_PPS_voltage(PD_protocol_t *p) { return p->PPS_voltage; } /* Voltage in 20mV units */
 static inline uint8_t  PD_protocol_get_PPS_current(PD_protocol_t *p) { return p->PPS_current; } /* Current in 50mA units */
+static inline bool     PD_protocol_is_AVS(PD_protocol_t *p) { return p->AVS; }
+/* Cable current from e-marker in 10mA units, 3A if not discovered. Limit set by PD_protocol_set_cable_current */
+uint16_t PD_protocol_get_cable_current(PD_protocol_t *p);
+static inline uint16_t PD_protocol_get_cable_limit(PD_protocol_t *p) { return p->cable_max_i; }
+static inline uint32_t PD_protocol_get_cable_vdo(PD_protocol_t *p) { return p->cable_vdo; }
+static inline uint16_t PD_protocol_get_cable_msg_header(PD_protocol_t *p) { return p->cable_msg_header; }
+/* Type of Alert of the last Alert, PD_ALERT_* bits. ADO has battery slots and extended alert event too */
+static inline uint8_t  PD_protocol_get_alert(PD_protocol_t *p) { return p->ADO >> 24; }
+static inline uint32_t PD_protocol_get_ADO(PD_protocol_t *p) { return p->ADO; }
+
+static inline bool     PD_protocol_is_EPR_mode(PD_protocol_t *p) { return p->EPR_state == PD_EPR_STATE_ON; }
+/* Source is EPR capable and EPR option or AVS voltage above 20V is set, EPR mode is not entered yet */
+bool PD_protocol_need_EPR_mode(PD_protocol_t *p);
 
 static inline uint16_t PD_protocol_get_tx_msg_header(PD_protocol_t *p) { return p->tx_msg_header; }
 static inline uint16_t PD_protocol_get_rx_msg_header(PD_protocol_t *p) { return p->rx_msg_header; }
+/* Specification Revision of the last received message, 2 for PD3.0 */
+static inline uint8_t  PD_protocol_get_spec_rev(PD_protocol_t *p) { return (p->rx_msg_header >> 6) & 0x3; }
 
 bool PD_protocol_get_msg_info(uint16_t header, PD_msg_info_t * msg_info);
 
 bool PD_protocol_get_power_info(PD_protocol_t *p, uint8_t index, PD_power_info_t *power_info);
 bool PD_protocol_get_PPS_status(PD_protocol_t *p, PPS_status_t * PPS_status);
+bool PD_protocol_get_status(PD_protocol_t *p, PD_status_t * status);
+/* Last reassembled extended message, valid until next extended message of any port */
+bool PD_protocol_get_ext_msg(PD_protocol_t *p, uint8_t *type, const uint8_t **data, uint16_t *size);
+
+/* Sink PDO for PD_protocol_set_sink_cap, voltage in 50mV, current in 10mA, power in 250mW units.
+   Reference: 6.4.1.3 Sink Capabilities Message */
+static inline uint32_t PD_protocol_sink_fixed(uint16_t v, uint16_t i)
+    { return ((uint32_t)PD_PDO_TYPE_FIXED_SUPPLY << 30) | ((uint32_t)(v & 0x3FF) << 10) | (i & 0x3FF); }
+static inline uint32_t PD_protocol_sink_variable(uint16_t min_v, uint16_t max_v, uint16_t i)
+    { return ((uint32_t)PD_PDO_TYPE_VARIABLE_SUPPLY << 30) | ((uint32_t)(max_v & 0x3FF) << 20) |
+             ((uint32_t)(min_v & 0x3FF) << 10) | (i & 0x3FF); }
+static inline uint32_t PD_protocol_sink_battery(uint16_t min_v, uint16_t max_v, uint16_t p)
+    { return ((uint32_t)PD_PDO_TYPE_BATTERY << 30) | ((uint32_t)(max_v & 0x3FF) << 20) |
+             ((uint32_t)(min_v & 0x3FF) << 10) | (p & 0x3FF); }
+static inline uint32_t PD_protocol_sink_PPS(uint16_t min_v, uint16_t max_v, uint16_t i)    /* 100mV and 50mA steps */
+    { return ((uint32_t)PD_PDO_TYPE_AUGMENTED_PDO << 30) | ((uint32_t)((max_v / 2) & 0xFF) << 17) |
+             ((uint32_t)((min_v / 2) & 0xFF) << 8) | ((i / 5) & 0x7F); }
 
-/* Set Fixed and Variable power option */
+/* Set Sink_Capabilities, up to 7 PDOs, the first is 5V Fixed. count=0 for default 5V 1A */
+bool PD_protocol_set_sink_cap(PD_protocol_t *p, const uint32_t *pdo, uint8_t count);
+
+/* Set Sink_Capabilities_Extended data, read when Get_Sink_Cap_Extended is received. ext=0 for default */
+static inline void PD_protocol_set_sink_cap_ext(PD_protocol_t *p, const PD_sink_cap_ext_t *ext) { p->sink_cap_ext = ext; }
+
+/* Set structured VDM responses, table=0 to NAK all */
+static inline void PD_protocol_set_VDM_table(PD_protocol_t *p, const PD_VDM_table_t *table) { p->VDM_table = table; }
+
+/* Set Fixed and Variable power option, a preset of power policy */
 bool PD_protocol_set_power_option(PD_protocol_t *p, enum PD_power_option_t option);
+bool PD_protocol_set_power_policy(PD_protocol_t *p, const PD_power_policy_t *policy);
 bool PD_protocol_select_power(PD_protocol_t *p, uint8_t index);
+/* Limit requested current to the cable in 10mA units, 0 for no limit. return true if re-send request is needed */
+bool PD_protocol_set_cable_current(PD_protocol_t *p, uint16_t max_i);
 
 /* Set PPS Voltage in 20mV units, Current in 50mA units. return true if re-send request is needed
    strict=true, If PPS setting is not qualified, return false, nothing is changed.
    strict=false, if PPS setting is not qualified, fall back to regular power option */
 bool PD_protocol_set_PPS(PD_protocol_t * p, uint16_t PPS_voltage, uint8_t PPS_current, bool strict);  
 
+/* Set AVS Voltage in 20mV units rounded down to 100mV, Current in 50mA units. Same return and strict as
+   PD_protocol_set_PPS. SPR AVS is 9V to 20V, EPR AVS above 20V enters EPR mode */
+bool PD_protocol_set_AVS(PD_protocol_t * p, uint16_t AVS_voltage, uint8_t AVS_current, bool strict);
+
 void PD_protocol_reset(PD_protocol_t *p);
 void PD_protocol_init(PD_protocol_t *p);
 
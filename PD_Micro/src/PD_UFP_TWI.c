@@ -0,0 +1,201 @@
+
+/**
+ * PD_UFP_TWI.c
+ *
+ *  Updated on: Oct 16, 2026
+ *      Author: Ryan Ma
+ *
+ * Interrupt driven TWI (I2C) master transport for AVR
+ * Transactions are queued as descriptors, the TWI interrupt runs the bus state machine
+ * and marks each descriptor complete, optional completion callback runs in interrupt context.
+ * The FUSB302 driver is synchronous, PD_UFP waits on its own descriptors until complete. Transfers
+ * submitted by the application complete in the background.
+ * Requires only stdint.h and avr-libc
+ *
+ * Register read:  START, SLA+W, reg_addr, repeated START, SLA+R, data ... NACK, STOP
+ * Register write: START, SLA+W, reg_addr, data ..., STOP
+ * A read can grow while receiving through the extend function, e.g. status registers followed
+ * by a FIFO packet whose length is only known from its header.
+ *
+ */
+
+#include "PD_UFP_TWI.h"
+
+#if defined(__AVR__) && PD_UFP_TWI_ENABLE
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+
+/* TWSR status codes, prescaler bits masked */
+#define TW_START            0x08
+#define TW_REP_START        0x10
+#define TW_MT_SLA_ACK       0x18
+#define TW_MT_SLA_NACK      0x20
+#define TW_MT_DATA_ACK      0x28
+#define TW_MT_DATA_NACK     0x30
+#define TW_ARB_LOST         0x38
+#define TW_MR_SLA_ACK       0x40
+#define TW_MR_SLA_NACK      0x48
+#define TW_MR_DATA_ACK      0x50
+#define TW_MR_DATA_NACK     0x58
+#define TW_STATUS_MASK      0xF8
+
+#define TWCR_IDLE           (_BV(TWEN))
+#define TWCR_NEXT           (_BV(TWEN) | _BV(TWIE) | _BV(TWINT))
+#define TWCR_START          (TWCR_NEXT | _BV(TWSTA))
+#define TWCR_STOP           (_BV(TWEN) | _BV(TWINT) | _BV(TWSTO))
+#define TWCR_STOP_START     (TWCR_NEXT | _BV(TWSTO) | _BV(TWSTA))
+
+#define QUEUE_MASK          (PD_UFP_TWI_QUEUE_SIZE - 1)
+
+enum {
+    PHASE_REG_ADDR = 0,     /* SLA+W sent, send register address */
+    PHASE_WRITE,            /* transmitting data */
+    PHASE_READ              /* repeated START sent, receiving data */
+};
+
+static PD_UFP_TWI_xfer_t * volatile queue[PD_UFP_TWI_QUEUE_SIZE];
+static volatile uint8_t queue_read;
+static volatile uint8_t queue_write;
+static uint8_t phase;
+static uint8_t data_index;
+
+void PD_UFP_TWI_init(uint32_t cpu_freq, uint32_t scl_freq)
+{
+    /* SCL = cpu_freq / (16 + 2 * TWBR), prescaler 1. TWBR 0 gives the fastest rate */
+    uint32_t div = scl_freq ? cpu_freq / scl_freq : 0;
+    TWSR &= ~(_BV(TWPS0) | _BV(TWPS1));
+    TWBR = div > 16 + 2 * 255 ? 255 : div > 16 ? (uint8_t)((div - 16) / 2) : 0;
+#if defined(__AVR_ATmega32U4__) || defined(__AVR_ATmega1280__) || defined(__AVR_ATmega2560__)
+    PORTD |= _BV(PD0) | _BV(PD1);   /* internal pull up on SCL (PD0) and SDA (PD1) */
+#elif defined(__AVR_ATmega328P__) || defined(__AVR_ATmega328__) || defined(__AVR_ATmega168__)
+    PORTC |= _BV(PC5) | _BV(PC4);   /* internal pull up on SCL (PC5) and SDA (PC4) */
+#endif
+    /* other MCUs rely on external pull ups */
+    if (queue_read == queue_write) {
+        TWCR = TWCR_IDLE;
+    }
+}
+
+uint8_t PD_UFP_TWI_submit(PD_UFP_TWI_xfer_t *xfer)
+{
+    uint8_t sreg = SREG, w;
+    cli();
+    w = queue_write;
+    if ((uint8_t)(w - queue_read) > QUEUE_MASK) {
+        SREG = sreg;
+        return 0;
+    }
+    xfer->status = PD_UFP_TWI_PENDING;
+    queue[w & QUEUE_MASK] = xfer;
+    queue_write = w + 1;
+    if (w == queue_read) {
+        /* bus idle, start once the previous STOP is on the bus. STOP never completes if a slave
+           holds SCL low, fail the transaction instead of waiting forever */
+        uint16_t n = 0;
+        while (TWCR & _BV(TWSTO)) {
+            if (++n == 0) {
+                queue_write = w;
+                xfer->status = PD_UFP_TWI_ERR_BUS;
+                if (xfer->callback) {
+                    xfer->callback(xfer);
+                }
+                SREG = sreg;
+                return 1;
+            }
+        }
+        phase = PHASE_REG_ADDR;
+        data_index = 0;
+        TWCR = TWCR_START;
+    }
+    SREG = sreg;
+    return 1;
+}
+
+void PD_UFP_TWI_reset(void)
+{
+    uint8_t sreg = SREG;
+    cli();
+    TWCR = 0;   /* disable TWI, SCL and SDA return to port control */
+    while (queue_read != queue_write) {
+        PD_UFP_TWI_xfer_t *xfer = queue[queue_read & QUEUE_MASK];
+        queue_read++;
+        xfer->status = PD_UFP_TWI_ERR_BUS;
+        if (xfer->callback) {
+            xfer->callback(xfer);
+        }
+    }
+    phase = PHASE_REG_ADDR;
+    data_index = 0;
+    SREG = sreg;
+}
+
+static void complete(PD_UFP_TWI_xfer_t *xfer, uint8_t status)
+{
+    uint8_t r = queue_read + 1;
+    queue_read = r;
+    phase = PHASE_REG_ADDR;
+    data_index = 0;
+    /* STOP, and chain a START if another transaction is queued */
+    TWCR = r != queue_write ? TWCR_STOP_START : TWCR_STOP;
+    xfer->status = status;
+    if (xfer->callback) {
+        xfer->callback(xfer);
+    }
+}
+
+ISR(TWI_vect)
+{
+    PD_UFP_TWI_xfer_t *xfer = queue[queue_read & QUEUE_MASK];
+    switch (TWSR & TW_STATUS_MASK) {
+    case TW_START:
+        TWDR = xfer->dev_addr << 1;
+        TWCR = TWCR_NEXT;
+        break;
+    case TW_REP_START:
+        TWDR = (xfer->dev_addr << 1) | 1;
+        TWCR = TWCR_NEXT;
+        break;
+    case TW_MT_SLA_ACK:
+        TWDR = xfer->reg_addr;
+        phase = xfer->direction == PD_UFP_TWI_READ ? PHASE_READ : PHASE_WRITE;
+        TWCR = TWCR_NEXT;
+        break;
+    case TW_MT_DATA_ACK:
+        if (phase == PHASE_READ) {
+            TWCR = TWCR_START;  /* repeated START for SLA+R */
+        } else if (data_index < xfer->count) {
+            TWDR = xfer->data[data_index++];
+            TWCR = TWCR_NEXT;
+        } else {
+            complete(xfer, PD_UFP_TWI_DONE);
+        }
+        break;
+    case TW_MR_SLA_ACK:
+        TWCR = xfer->count > 1 ? TWCR_NEXT | _BV(TWEA) : TWCR_NEXT;
+        break;
+    case TW_MR_DATA_ACK:
+        xfer->data[data_index++] = TWDR;
+        if (xfer->extend) {
+            /* decide ACK or NACK of the next byte with the data received so far */
+            xfer->count = xfer->extend(xfer->data, data_index, xfer->count);
+        }
+        TWCR = (uint8_t)(data_index + 1) < xfer->count ? TWCR_NEXT | _BV(TWEA) : TWCR_NEXT;
+        break;
+    case TW_MR_DATA_NACK:
+        xfer->data[data_index++] = TWDR;
+        complete(xfer, PD_UFP_TWI_DONE);
+        break;
+    case TW_MT_SLA_NACK:
+    case TW_MT_DATA_NACK:
+    case TW_MR_SLA_NACK:
+        complete(xfer, PD_UFP_TWI_ERR_NACK);
+        break;
+    case TW_ARB_LOST:
+    default:
+        complete(xfer, PD_UFP_TWI_ERR_BUS);
+        break;
+    }
+}
+
+#endif
@@ -0,0 +1,73 @@
+
+/**
+ * PD_UFP_TWI.h
+ *
+ *  Updated on: Oct 16, 2026
+ *      Author: Ryan Ma
+ *
+ * Interrupt driven TWI (I2C) master transport for AVR
+ * Transactions are queued as descriptors, the TWI interrupt runs the bus state machine
+ * and marks each descriptor complete, optional completion callback runs in interrupt context.
+ * The FUSB302 driver is synchronous, PD_UFP waits on its own descriptors until complete. Transfers
+ * submitted by the application complete in the background.
+ * Requires only stdint.h and avr-libc
+ *
+ * Wire library defines the same TWI interrupt vector. Set PD_UFP_TWI_ENABLE to 1 only if
+ * the sketch does not include Wire.h, otherwise PD_UFP falls back to blocking Wire calls.
+ *
+ */
+
+#ifndef PD_UFP_TWI_H
+#define PD_UFP_TWI_H
+
+#include <stdint.h>
+
+#ifndef PD_UFP_TWI_ENABLE
+#define PD_UFP_TWI_ENABLE           0
+#endif
+
+#define PD_UFP_TWI_QUEUE_SIZE       4       /* array size must be power of 2 */
+
+#define PD_UFP_TWI_WRITE            0
+#define PD_UFP_TWI_READ             1
+
+enum {
+    PD_UFP_TWI_DONE             = 0,
+    PD_UFP_TWI_PENDING          = 1,
+    PD_UFP_TWI_ERR_NACK         = 2,
+    PD_UFP_TWI_ERR_BUS          = 3
+};
+
+struct PD_UFP_TWI_xfer_t;
+typedef void (*PD_UFP_TWI_callback_t)(struct PD_UFP_TWI_xfer_t *xfer);
+/* Return updated byte count of a read from the bytes received so far, called in interrupt context */
+typedef uint8_t (*PD_UFP_TWI_extend_t)(const uint8_t *data, uint8_t received, uint8_t count);
+
+typedef struct PD_UFP_TWI_xfer_t {
+    /* setup by user */
+    uint8_t dev_addr;
+    uint8_t reg_addr;
+    uint8_t direction;      /* PD_UFP_TWI_WRITE or PD_UFP_TWI_READ */
+    uint8_t count;
+    uint8_t *data;
+    PD_UFP_TWI_callback_t callback;     /* optional, called in interrupt context */
+    PD_UFP_TWI_extend_t extend;         /* optional, read only, extend count while receiving */
+    void *context;
+
+    /* updated by transport */
+    volatile uint8_t status;
+} PD_UFP_TWI_xfer_t;
+
+/* Set SCL frequency, cpu_freq is the actual CPU clock after prescaler */
+void PD_UFP_TWI_init(uint32_t cpu_freq, uint32_t scl_freq);
+
+/* Queue a transaction, return 0 if queue is full. Descriptor must stay valid until complete */
+uint8_t PD_UFP_TWI_submit(PD_UFP_TWI_xfer_t *xfer);
+
+/* Abort all queued transactions with PD_UFP_TWI_ERR_BUS and release the bus lines,
+   e.g. on timeout. Call PD_UFP_TWI_init to enable TWI again */
+void PD_UFP_TWI_reset(void);
+
+static inline uint8_t PD_UFP_TWI_is_pending(PD_UFP_TWI_xfer_t *xfer) { return xfer->status == PD_UFP_TWI_PENDING; }
+
+#endif